@@ -45,9 +45,30 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
+// Virtual address at which to receive page mappings containing client
+// requests.  Serving thread i uses the page i pages below it.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Threads waiting for and serving requests
+#define NSERVE		4
+
+// Serving thread i handles requests that come in registers, without a
+// page, in fssmall[i], and replies with its first IPC_NWORDS words.
+static union Fsipc fssmall[NSERVE] __attribute__((aligned(PGSIZE)));
+
+// Request rings set up with FSREQ_RING are mapped at RINGVA + i * PGSIZE
+// and served by a thread each, until no client maps them any more.
+#define RINGVA		0x0e000000
+#define MAXRING		64
+// How often the thread of an idle ring checks for that
+#define RING_IDLE_MSEC	1000
+
+static envid_t ringenv[MAXRING];	// Env that set up ring i, or 0
+
+// The handlers take turns: the block cache, the bitmap and opentab are
+// not safe for concurrent use.  Only the waiting is concurrent.
+static mutex_t fs_lock;
+
 void
 serve_init(void)
 {
@@ -316,44 +337,173 @@ fshandler handlers[] = {
 	[FSREQ_SYNC] =		serve_sync
 };
 
-void
-serve(void)
+// Serve the request posted in slot for envid.  The request is copied
+// out of the shared page first, so that the client can't change it
+// under the handler, and has its size cut down so that the reply fits.
+static void
+serve_slot(envid_t envid, struct Fsslot *slot)
+{
+	char body[FSSLOT_BODY] __attribute__((aligned(sizeof(uint32_t))));
+	union Fsipc *ipc = (union Fsipc *) body;
+	uint32_t type, s;
+	int r;
+
+	static_assert(sizeof(struct Fsret_stat) <= FSSLOT_BODY);
+	// Read the request only after seeing it posted
+	__sync_synchronize();
+	type = slot->fs_type;
+	memmove(body, slot->fs_body, FSSLOT_BODY);
+	if (type == FSREQ_READ)
+		ipc->read.req_n = MIN(ipc->read.req_n, FSSLOT_BODY);
+	else if (type == FSREQ_WRITE)
+		ipc->write.req_n = MIN(ipc->write.req_n,
+			FSSLOT_BODY - offsetof(struct Fsreq_write, req_buf));
+
+	if (type < ARRAY_SIZE(handlers) && handlers[type])
+		r = handlers[type](envid, ipc);
+	else
+		r = -E_INVAL;
+
+	// xchg is a full barrier: the reply is there before the slot is
+	// seen done
+	memmove(slot->fs_body, body, FSSLOT_BODY);
+	slot->fs_ret = r;
+	s = xchg(&slot->fs_state, FSSLOT_DONE);
+	if (s & FSSLOT_WAIT)
+		sys_futex_wake(&slot->fs_state, 1);
+}
+
+// Serve the requests posted in ring i, a batch at a time, until none of
+// its clients maps it any more.  Runs in a thread of its own.
+static void
+serve_ring(void *arg)
+{
+	int i = (int) arg;
+	struct Fsring *ring = (struct Fsring *) (RINGVA + i * PGSIZE);
+	struct Fsslot *slot;
+	uint32_t bell;
+	int n;
+
+	while (pageref(ring) > 1) {
+		bell = ring->fr_doorbell & ~1;
+		__sync_synchronize();
+		n = 0;
+		mutex_lock(&fs_lock);
+		for (slot = ring->fr_slots; slot < ring->fr_slots + FSRING_NSLOT; slot++)
+			if ((slot->fs_state & ~FSSLOT_WAIT) == FSSLOT_REQ) {
+				serve_slot(ringenv[i], slot);
+				n++;
+			}
+		mutex_unlock(&fs_lock);
+		if (n > 0)
+			continue;
+
+		// Sleep until a client rings, unless one just has
+		if (__sync_bool_compare_and_swap(&ring->fr_doorbell, bell, bell | 1)) {
+			sys_futex_wait(&ring->fr_doorbell, bell | 1, RING_IDLE_MSEC);
+			__sync_fetch_and_and(&ring->fr_doorbell, ~1);
+		}
+	}
+
+	sys_page_unmap(0, ring);
+	mutex_lock(&fs_lock);
+	ringenv[i] = 0;
+	mutex_unlock(&fs_lock);
+}
+
+// Take over the request page at ipc, which envid shares with us, as a
+// request ring, and start a thread to serve it.
+static int
+serve_ring_open(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsring *ring;
+	int i, r;
+
+	for (i = 0; i < MAXRING; i++)
+		if (!ringenv[i])
+			break;
+	if (i == MAXRING)
+		return -E_MAX_OPEN;
+
+	ring = (struct Fsring *) (RINGVA + i * PGSIZE);
+	if ((r = sys_page_map(0, ipc, 0, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	// Its thread looks at the page's references to tell when it is
+	// no longer used
+	sys_page_unmap(0, ipc);
+	ringenv[i] = envid;
+	if ((r = create_thread(serve_ring, (void *) i)) < 0) {
+		sys_page_unmap(0, ring);
+		ringenv[i] = 0;
+		return r;
+	}
+	return 0;
+}
+
+static void
+serve(void *arg)
 {
-	uint32_t req, whom;
-	int perm, r;
+	union Fsipc *req_va = arg;
+	union Fsipc *small = &fssmall[fsreq - req_va];
+	union Fsipc *ipc;
+	uint32_t req, whom, words[IPC_NWORDS];
+	const uint32_t *rwords = NULL;
+	thdid_t client = 0;
+	int perm, rperm = 0, r = 0;
 	void *pg;
 
 	while (1) {
+		// Reply to the thread that sent the last request, if any,
+		// and wait for the next in the same system call
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
-
-		// All requests must contain an argument page
+		req = ipc_reply_waitw(client, r, rwords, IPC_THD,
+				      (int32_t *) &whom, req_va, &perm, words);
+		client = thisthd->thd_ipc_from_thd;
+
+		// A request without an argument page is a small one, sent
+		// in registers; so is its reply
+		ipc = req_va;
+		rwords = NULL;
 		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n",
-				whom);
-			continue; // just leave it hanging...
+			memmove(small, words, sizeof(words));
+			ipc = small;
+			rwords = (const uint32_t *) small;
 		}
+		if (debug)
+			cprintf("fs req %d from %08x [page %08x: %s]\n",
+				req, whom, uvpt[PGNUM(req_va)], ipc);
 
+		mutex_lock(&fs_lock);
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+			r = serve_open(whom, (struct Fsreq_open*)ipc, &pg, &rperm);
+		} else if (req == FSREQ_RING) {
+			r = ipc == req_va ? serve_ring_open(whom, ipc) : -E_INVAL;
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, ipc);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		// The client must hold the Fd page before another thread's
+		// openfile_alloc can take it for free again.
+		if (pg) {
+			sys_ipc_send(client, r, pg, rperm | IPC_THD);
+			client = 0;
+		}
+		mutex_unlock(&fs_lock);
+		// Don't keep the client's page mapped while we wait: it holds
+		// a reference to the page until the next request replaces it
+		if (ipc == req_va)
+			sys_page_unmap(0, req_va);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	int i, r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -364,6 +514,9 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
-	serve();
+	for (i = 1; i < NSERVE; i++)
+		if ((r = create_thread(serve, fsreq - i)) < 0)
+			panic("create_thread: %e", r);
+	serve(fsreq);
 }
 
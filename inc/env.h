@@ -6,33 +6,44 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/spinlock.h>
 
 typedef int32_t envid_t;
 typedef int32_t thdid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+---------------19---------------+---------12---------+
+// |0|          Uniqueifier           |    Environment     |
+// | |                                |       Index        |
+// +----------------------------------+--------------------+
+//                                     \---- ENVX(eid) ---/
 //
 // The environment index ENVX(eid) equals the environment's index in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
+// Thread ids are made up the same way, with a 13-bit THDX(tid).
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
+//
+// envs[] and thds[] start out small and grow as needed, up to NENV and
+// NTHD entries; struct EnvTabs says how many entries exist so far.
 
-#define LOG2NENV		10
+#define LOG2NENV		12
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
-#define LOG2NTHD		10
+#define LOG2NTHD		13
 #define NTHD			(1 << LOG2NTHD)
 #define THDX(thdid)		((thdid) & (NTHD - 1))
 
+// Maximum number of CPUs
+#define NCPU			8
+
+// Words an IPC message carries besides its value, see kern/ipc.c
+#define IPC_NWORDS		4
+
 // Values of env_status in struct Env
 enum EnvStatus{
 	ENV_FREE = 0,
@@ -51,6 +62,13 @@ enum ThdStatus {
 	THD_NOT_RUNNABLE
 };
 
+// Thread priorities, nice-style: a lower value means a larger share of
+// the CPU.  Each step is worth roughly 10% (see kern/sched.c).
+#define THD_PRIO_MIN		-20
+#define THD_PRIO_MAX		19
+#define THD_PRIO_DEFAULT	0
+#define THD_PRIO_SERVER		-5	// Default for the fs and ns servers
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -74,17 +92,27 @@ struct Env {
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct spinlock env_vm_lock;	// Protects env_pgdir and its page tables
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
-	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
-	struct Thd *env_ipc_thd;	// 接受的线程
-	void *env_ipc_dstva;		// VA at which to map received page
-	uint32_t env_ipc_value;		// Data value sent to us
-	envid_t env_ipc_from;		// envid of the sender
-	int env_ipc_perm;		// Perm of page mapping received
+	// Lab 4 IPC.  Each thread receives for itself, see struct Thd.
+	struct spinlock env_ipc_lock;	// Protects the env_ipc_* and thd_ipc_* fields
+	struct Thd *env_ipc_recv_head;	// Threads blocked receiving, by thd_ipc_next
+	struct Thd *env_ipc_recv_tail;
+	struct IpcMbox *env_ipc_mbox;	// Messages sent while not receiving
+	uint32_t env_ipc_queued;	// Messages waiting in env_ipc_mbox
+	uint32_t env_ipc_nqueued;	// Sends that had to be queued
+	uint32_t env_ipc_nblocked;	// Sends that had to block, queue full
+	uint32_t env_ipc_ndropped;	// Sends refused, queue full
+
+	// Accounting totals of the env's threads that have exited.  Add
+	// those of env_thd_head.. for the env as a whole.
+	uint64_t env_runtime;
+	uint64_t env_wait_time;
+	uint32_t env_runs;
+	uint32_t env_migrations;
 };
 
 struct Thd { // 线程结构
@@ -96,8 +124,67 @@ struct Thd { // 线程结构
 	struct Thd *thd_next;	// 双向链表后一节点
 	enum ThdStatus thd_status;	// 状态
 	uint32_t thd_runs;		// 来自Env，运行的数量
+	int thd_priority;		// THD_PRIO_MIN..THD_PRIO_MAX
+	uint64_t thd_runtime;		// TSC cycles spent running
+	uint64_t thd_vruntime;		// Runtime scaled by priority weight
 	int thd_cpunum;			// 来自Env，运行的CPU
+	uint32_t thd_affinity;		// Bit i set: may run on CPU i
+	uint32_t thd_migrations;	// Times moved to another CPU
+	uint64_t thd_last_ran;		// TSC when it last left a CPU
+	uint64_t thd_wait_time;		// TSC cycles spent runnable but queued
+	uint64_t thd_queued_at;		// TSC when it joined its run queue
 	uintptr_t thd_uxstack;
+
+	// Per-CPU run queue linkage (see kern/sched.c)
+	struct Thd *thd_rq_prev;
+	struct Thd *thd_rq_next;
+	int thd_rq_cpu;			// CPU whose run queue holds us, or -1
+
+	// Sleep queue linkage (see kern/sched.c)
+	struct Thd *thd_sleep_prev;
+	struct Thd *thd_sleep_next;
+	uint64_t thd_wakeup;		// TSC deadline while sleeping, else 0
+	bool thd_sleep_futex;		// Sleeping as a futex_wait timeout
+
+	// Futex wait queue linkage, see kern/futex.c
+	physaddr_t thd_futex_key;	// Futex waited on, or 0
+	uint32_t thd_futex_seq;		// Counts futex waits
+	struct Thd *thd_futex_prev;
+	struct Thd *thd_futex_next;
+
+	// IPC receive state, see kern/ipc.c
+	bool thd_ipc_recving;		// Blocked receiving
+	void *thd_ipc_dstva;		// VA at which to map received page
+	uint32_t thd_ipc_value;		// Data value sent to us
+	uint32_t thd_ipc_words[IPC_NWORDS]; // Words sent along with it
+	envid_t thd_ipc_from;		// envid of the sender
+	thdid_t thd_ipc_from_thd;	// thdid of the sending thread
+	int thd_ipc_perm;		// Perm of page mapping received
+	struct Thd *thd_ipc_next;	// On our env's receivers or thd_ipc_to's senders
+
+	// Send blocked on a full mailbox
+	struct Env *thd_ipc_to;		// Env whose mailbox, or NULL
+	thdid_t thd_ipc_out_thd;	// Thread the message is for, or 0
+	uint32_t thd_ipc_out_value;
+	uint32_t thd_ipc_out_words[IPC_NWORDS];
+	struct PageInfo *thd_ipc_out_pp;
+	int thd_ipc_out_perm;
+};
+
+// Per-CPU scheduler accounting, mapped read-only at UCPUSTATS
+struct CpuStat {
+	uint64_t cs_busy;		// TSC cycles spent running threads
+	uint64_t cs_idle;		// TSC cycles spent with nothing to run
+	uint32_t cs_switches;		// Switches to a different thread
+	uint32_t cs_steals;		// Threads taken from other CPUs
+	uint32_t cs_handoffs;		// Switches by sched_handoff
+};
+
+// Current size of the env and thread tables, mapped read-only at
+// UENVTABS.  Entries past these counts are not mapped at all.
+struct EnvTabs {
+	uint32_t et_nenv;		// envs[0..et_nenv) exist
+	uint32_t et_nthd;		// thds[0..et_nthd) exist
 };
 
 #endif // !JOS_INC_ENV_H
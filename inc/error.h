@@ -18,6 +18,8 @@ enum {
 	E_EOF		,	// Unexpected end of file
 
 	E_IPC_RECVING	,	// 另一个线程在recving
+	E_AGAIN		,	// Futex value changed; try again
+	E_TIMEOUT	,	// Wait timed out
 
 	// File system error codes -- only seen in user-level
 	E_NO_DISK	,	// No free space left on disk
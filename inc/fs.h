@@ -70,7 +70,9 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Ring sets up the struct Fsring on the request page
+	FSREQ_RING
 };
 
 union Fsipc {
@@ -113,4 +115,42 @@ union Fsipc {
 	char _pad[PGSIZE];
 };
 
+// A request ring: a page that a client shares with the file server for
+// good once FSREQ_RING sets it up, and in which it posts small requests
+// without an IPC each (see lib/fsring.c).  A slot holds one request, and
+// its reply in place, in the first FSSLOT_BODY bytes of a union Fsipc.
+// Open is not served this way, since it passes a page.
+#define FSRING_NSLOT	15
+#define FSSLOT_BODY	240
+
+// Values of fs_state.  The client owns a slot while it is free, being
+// filled or done; the server while it is posted.  FSSLOT_WAIT is or'ed
+// in while the client sleeps on fs_state for the reply.
+enum {
+	FSSLOT_FREE = 0,
+	FSSLOT_FILL,
+	FSSLOT_REQ,
+	FSSLOT_DONE
+};
+#define FSSLOT_WAIT	0x100
+
+struct Fsslot {
+	volatile uint32_t fs_state;
+	uint32_t fs_type;		// FSREQ_*
+	int32_t fs_ret;			// Result, once done
+	uint32_t fs_pad;
+	char fs_body[FSSLOT_BODY];
+};
+
+struct Fsring {
+	// Bumped by 2 for every request posted; bit 0 is set while the
+	// server sleeps on it and wants a futex wake
+	volatile uint32_t fr_doorbell;
+	// Bumped by 2 for every slot freed; bit 0 is set while a client
+	// sleeps on it for a free slot
+	volatile uint32_t fr_free;
+	char fr_pad[sizeof(struct Fsslot) - 2 * sizeof(uint32_t)];
+	struct Fsslot fr_slots[FSRING_NSLOT];
+};
+
 #endif /* !JOS_INC_FS_H */
@@ -36,7 +36,9 @@ extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 extern volatile thdid_t main_thdid;
 #define thds ((struct Thd *)&envs[NENV])
-#define thisthd (&thds[ENVX(sys_getthdid())])
+#define cpustats ((const volatile struct CpuStat *)&thds[NTHD])
+#define envtabs ((const volatile struct EnvTabs *)&cpustats[NCPU])
+#define thisthd (&thds[THDX(sys_getthdid())])
 
 // exit.c
 void	exit(void);
@@ -60,8 +62,16 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_reserve(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_vec(struct PageMapOp *ops, int n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
-int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg, uint32_t *value_store, uint32_t *words_store);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg, uint32_t *value_store,
+			   uint32_t *words_store);
+int	sys_ipc_recv(void *rcv_pg, uint32_t *value_store, uint32_t *words_store);
 int sys_packet_try_send(void *data_va, int len);
 int sys_packet_receive(void *data_va, int *len);
 
@@ -71,6 +81,12 @@ int sys_thd_destroy(thdid_t tid);
 int sys_thd_set_status(thdid_t tid, int status);
 int sys_thd_set_trapframe(thdid_t tid, struct Trapframe * tf );
 int sys_thd_set_uxstack(thdid_t tid,uintptr_t uxstack );
+int sys_thd_set_priority(thdid_t tid, int prio);
+int sys_thd_sleep(uint32_t msec);
+int sys_thd_set_affinity(thdid_t tid, uint32_t cpumask);
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val, uint32_t timeout);
+int sys_futex_wake(volatile uint32_t *addr, int n);
+envid_t	sys_fork(void);
 
 unsigned int sys_time_msec(void);
 
@@ -88,11 +104,32 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recvw(envid_t *from_env_store, void *pg, int *perm_store,
+		  uint32_t *words_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_callw(envid_t to_env, uint32_t value, const uint32_t *words,
+		  uint32_t *words_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_reply_waitw(envid_t to_env, uint32_t value, const uint32_t *words,
+			int perm, envid_t *from_env_store, void *rcv_pg,
+			int *perm_store, uint32_t *words_store);
 envid_t	ipc_find_env(enum EnvType type);
 
+// pagemap.c
+struct PageMapVec {
+	int n;
+	struct PageMapOp ops[PAGE_MAP_VEC_MAX];
+};
+void	pagemap_init(struct PageMapVec *v);
+int	pagemap_add(struct PageMapVec *v, void *srcva, envid_t dstenv,
+		    void *dstva, int perm);
+int	pagemap_flush(struct PageMapVec *v);
+
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -112,6 +149,15 @@ int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
 
+// fsring.c
+// Just below the fd table (see lib/fd.c)
+#define FSRINGVA	0xCFFFF000
+int	fsring_open(void);
+bool	fsring_active(void);
+int	fsring_submit(unsigned type, const void *req, size_t n);
+int	fsring_wait(int slot, void *ret, size_t n);
+int	fsring_call(unsigned type, const void *req, size_t n, void *ret, size_t retn);
+
 // pageref.c
 int	pageref(void *addr);
 
@@ -134,6 +180,15 @@ int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
 
+// nsring.c
+// Just below the file server's (see FSRINGVA)
+#define NSRINGVA	0xCFFFE000
+int	nsring_open(void);
+bool	nsring_active(void);
+int	nsring_submit(unsigned type, const void *req, size_t n);
+int	nsring_wait(int slot, void *ret, size_t n);
+int	nsring_call(unsigned type, const void *req, size_t n, void *ret, size_t retn);
+
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
@@ -170,6 +225,23 @@ thdid_t create_thread(void(*func)(void*), void*para);
 int delete_thread(thdid_t tar);
 void wait_thread(thdid_t tar);
 
+// mutex.c
+// Blocking mutexes and condition variables built on sys_futex_*.  They
+// work across envs if they live in a PTE_SHARE page.  Zero-initialize.
+typedef struct {
+	volatile uint32_t state;	// 0 free, 1 held, 2 held with waiters
+} mutex_t;
+typedef struct {
+	volatile uint32_t seq;		// Bumped by every signal
+} cond_t;
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+void cond_wait(cond_t *c, mutex_t *m);
+int cond_timedwait(cond_t *c, mutex_t *m, uint32_t msec);
+void cond_signal(cond_t *c);
+void cond_broadcast(cond_t *c);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
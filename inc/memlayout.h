@@ -51,13 +51,15 @@
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *    UENVS  ------->  +------------------------------+ 0xeec00000
+ *                     |       ENVS (kernel view)     | RW/--  PTSIZE
+ * UTOP,KENVS ------>  +------------------------------+ 0xee800000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee7ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee7fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee7fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -106,6 +108,7 @@
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
  * They are global pages mapped in at env allocation time.
+ * (Except KENVS, which the user can't see at all.)
  */
 
 // User read-only virtual page table (see 'uvpt' below)
@@ -115,13 +118,18 @@
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
 #define UTHDS		(UENVS + NENV * sizeof(struct Env))
+#define UCPUSTATS	(UTHDS + NTHD * sizeof(struct Thd))
+#define UENVTABS	(UCPUSTATS + NCPU * sizeof(struct CpuStat))
+// The kernel's read-write mapping of the same pages.  The tables grow a
+// page at a time, so they can't live in the KERNBASE mapping.
+#define KENVS		(UENVS - PTSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
  */
 
 // Top of user-accessible VM
-#define UTOP		UENVS
+#define UTOP		KENVS
 // Top of one-page user exception stack
 #define UXSTACKTOP	UTOP
 // Next page left invalid to guard against exception stack overflow; then:
@@ -182,6 +190,9 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous block on the free list, so that a free block can be
+	// taken off the middle of its list when it merges with its buddy.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -189,6 +200,11 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Only meaningful for the first page of a block of 1 << pp_order
+	// pages: the block's size, and whether it is on a free list.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
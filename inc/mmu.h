@@ -69,6 +69,17 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Two of them mean something to fork (both the library's and sys_fork):
+// PTE_SHARE pages are shared with the child as they are, and PTE_COW
+// marks copy-on-write pages.
+#define PTE_SHARE	0x400
+#define PTE_COW		0x800
+
+// The hardware ignores everything but PTE_P in a non-present PTE.  With
+// PTE_ANON there, the page is reserved as demand-zero memory (see
+// sys_page_reserve); the PTE_SYSCALL bits are the permissions it gets.
+#define PTE_ANON	0x100
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,6 +100,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -35,6 +35,10 @@ enum {
 
 	// The following message passes no page
 	NSREQ_TIMER,
+
+	// The following message passes a page, which the server keeps as
+	// a request ring
+	NSREQ_RING,
 };
 
 union Nsipc {
@@ -103,4 +107,44 @@ union Nsipc {
 	char _pad[PGSIZE];
 };
 
+// Request rings, set up with NSREQ_RING: a page of slots in which a
+// client posts socket requests, NSREQ_ACCEPT through NSREQ_SOCKET,
+// without an IPC each (see lib/nsring.c).  They work like the file
+// server's (see inc/fs.h); a slot holds one request, and its reply in
+// place, in the first NSSLOT_BODY bytes of a union Nsipc.
+#define NSRING_NSLOT	15
+#define NSSLOT_BODY	240
+
+// Values of ns_state.  The client owns a slot while it is free, being
+// filled or done; the server while it is posted or being served.
+// NSSLOT_WAIT is or'ed in while the client sleeps on ns_state for the
+// reply.
+enum {
+	NSSLOT_FREE = 0,
+	NSSLOT_FILL,
+	NSSLOT_REQ,
+	NSSLOT_SERVE,
+	NSSLOT_DONE
+};
+#define NSSLOT_WAIT	0x100
+
+struct Nsslot {
+	volatile uint32_t ns_state;
+	uint32_t ns_type;		// NSREQ_*
+	int32_t ns_ret;			// Result, once done
+	uint32_t ns_pad;
+	char ns_body[NSSLOT_BODY];
+};
+
+struct Nsring {
+	// Bumped by 2 for every request posted; bit 0 is set while the
+	// server sleeps on it and wants a futex wake
+	volatile uint32_t nr_doorbell;
+	// Bumped by 2 for every slot freed; bit 0 is set while a client
+	// sleeps on it for a free slot
+	volatile uint32_t nr_free;
+	char nr_pad[sizeof(struct Nsslot) - 2 * sizeof(uint32_t)];
+	struct Nsslot nr_slots[NSRING_NSLOT];
+};
+
 #endif // !JOS_INC_NS_H
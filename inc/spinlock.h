@@ -0,0 +1,39 @@
+#ifndef JOS_INC_SPINLOCK_H
+#define JOS_INC_SPINLOCK_H
+
+#include <inc/types.h>
+
+// The lock layout is shared with user space because locks are embedded
+// in structures (such as struct Env) that are mapped read-only at UENVS.
+// Only the kernel ever acquires them; see kern/spinlock.h.
+
+// Comment this to disable spinlock debugging
+#define DEBUG_SPINLOCK
+
+struct CpuInfo;
+
+// Mutual exclusion lock.  A ticket lock: CPUs are served in the order
+// in which they drew a ticket, and spin reading owner until it is theirs.
+struct spinlock {
+	volatile unsigned next;	// Next ticket to hand out
+	volatile unsigned owner;	// Ticket being served; held if != next
+
+#ifdef DEBUG_SPINLOCK
+	// For debugging:
+	char *name;            // Name of lock.
+	struct CpuInfo *cpu;   // The CPU holding the lock.
+	uintptr_t pcs[10];     // The call stack (an array of program counters)
+	                       // that locked the lock.
+
+	// Contention statistics, see spin_dump
+	uint32_t acquires;     // Times acquired
+	uint32_t contended;    // Times it had to wait
+	uint64_t spin_cycles;  // TSC cycles spent waiting
+	uint64_t max_hold;     // Longest time held, in TSC cycles
+	uint64_t acquired_at;  // TSC when last acquired
+	struct spinlock *stats_next;	// All locks that have been used
+	bool stats_listed;
+#endif
+};
+
+#endif	// !JOS_INC_SPINLOCK_H
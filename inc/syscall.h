@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -25,7 +27,41 @@ enum {
 	SYS_thd_set_status,
 	SYS_thd_set_trapframe,
 	SYS_thd_set_uxstack,
+	SYS_thd_set_priority,
+	SYS_thd_sleep,
+	SYS_thd_set_affinity,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_fork,
+	SYS_page_reserve,
+	SYS_page_map_vec,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
 	NSYSCALLS
 };
 
+// One operation of sys_page_map_vec: map the caller's page at pm_srcva
+// at pm_dstva in pm_dstenv with permission pm_perm, as sys_page_map
+// would.  The kernel stores what sys_page_map would return in pm_status.
+struct PageMapOp {
+	void *pm_srcva;
+	envid_t pm_dstenv;
+	void *pm_dstva;
+	int pm_perm;
+	int pm_status;
+};
+
+// The most operations one sys_page_map_vec takes
+#define PAGE_MAP_VEC_MAX	32
+
+// In the perm of an IPC send: the target is the thread with that thdid
+// rather than any thread of the env with that envid.
+#define IPC_THD			0x1000
+
+// In the perm of an IPC send: srcva points to IPC_NWORDS words to send
+// along with the value, instead of at a page.  The receiving thread gets
+// them in registers, see sys_ipc_recv.
+#define IPC_WORDS		0x2000
+
 #endif /* !JOS_INC_SYSCALL_H */
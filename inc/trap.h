@@ -36,7 +36,9 @@
 #define IRQ_KBD          1
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
+#define IRQ_RESCHED     13	// IPI: look at the run queues again
 #define IRQ_IDE         14
+#define IRQ_TLB         15	// IPI: another CPU changed our page tables
 #define IRQ_ERROR       19
 
 #ifndef __ASSEMBLER__
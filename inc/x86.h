@@ -257,7 +257,20 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	asm volatile("lock; xchgl %0, %1"
 		     : "+m" (*addr), "=a" (result)
 		     : "1" (newval)
-		     : "cc");
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add inc to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	uint32_t result;
+
+	asm volatile("lock; xaddl %0, %1"
+		     : "=r" (result), "+m" (*addr)
+		     : "0" (inc)
+		     : "cc", "memory");
 	return result;
 }
 
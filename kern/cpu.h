@@ -7,9 +7,6 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
-// Maximum number of CPUs
-#define NCPU  8
-
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -24,6 +21,23 @@ struct CpuInfo {
 	// struct Env *cpu_env;         // The currently-running environment.
 	struct Thd *cpu_thd;			// 改为存储当前运行的线程
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+
+	// Runnable threads waiting for this CPU, linked by thd_rq_next.
+	// cpu_rq_lock also protects the scheduling state (thd_status,
+	// thd_cpunum) of every thread whose thd_cpunum names this CPU,
+	// as well as cpu_thd.
+	struct spinlock cpu_rq_lock;
+	struct Thd *cpu_rq_head;
+	struct Thd *cpu_rq_tail;
+	int cpu_rq_len;
+	uint64_t cpu_min_vruntime;	// Floor for the vruntime of queued threads
+	uint64_t cpu_exec_start;	// TSC when cpu_thd was last charged
+
+	// Page directory loaded in CR3 (see pmap_switch), and the TLB
+	// shootdown state in kern/pmap.c.
+	pde_t *volatile cpu_pgdir;
+	volatile uint32_t cpu_tlb_pending;	// Set until we handle tlb_req
+	struct TlbBatch *cpu_tlb_batch;		// Deferred shootdowns, or NULL
 };
 
 // Initialized in mpconfig.c
@@ -32,6 +46,9 @@ extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 
+// Scheduler accounting, cpustats[i] for cpus[i] (see kern/sched.c)
+extern struct CpuStat *cpustats;
+
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
@@ -43,5 +60,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
+void lapic_timer_calibrate(uint32_t tsc_per_ms);
+void lapic_timer_set(uint32_t usec);
 
 #endif
@@ -1,5 +1,6 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 #include <inc/string.h>
 
 // LAB 6: Your driver code here
@@ -16,6 +17,13 @@ struct e1000_rdt *rdt;
 struct e1000_rx_desc rx_desc_array[RXDESCS];
 char rx_buffer_array[RXDESCS][RX_PKT_SIZE];
 
+// Serializes access to the descriptor rings from different CPUs
+static struct spinlock e1000_lock = {
+#ifdef DEBUG_SPINLOCK
+       .name = "e1000_lock"
+#endif
+};
+
 uint32_t E1000_MAC[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 
 int
@@ -129,9 +137,11 @@ e1000_receive_init()
 int
 e1000_transmit(void *data, size_t len)
 {
+       int r = -E_TRANSMIT_RETRY;
+       spin_lock(&e1000_lock);
        uint32_t current = tdt->tdt;		//tail index in queue
        if(!(tx_desc_array[current].status & E1000_TXD_STAT_DD)) {
-               return -E_TRANSMIT_RETRY;
+               goto out;
        }
        tx_desc_array[current].length = len;
        tx_desc_array[current].status &= ~E1000_TXD_STAT_DD;
@@ -139,24 +149,32 @@ e1000_transmit(void *data, size_t len)
        memcpy(tx_buffer_array[current], data, len);
        uint32_t next = (current + 1) % TXDESCS;
        tdt->tdt = next;
-       return 0;
+       r = 0;
+out:
+       spin_unlock(&e1000_lock);
+       return r;
 }
 
 int
 e1000_receive(void *addr, size_t *len)
 {
        static int32_t next = 0;
+       int r = -E_RECEIVE_RETRY;
+       spin_lock(&e1000_lock);
        if(!(rx_desc_array[next].status & E1000_RXD_STAT_DD)) {	//simply tell client to retry
-               return -E_RECEIVE_RETRY;
+               goto out;
        }
        if(rx_desc_array[next].errors) {
                cprintf("receive errors\n");
-               return -E_RECEIVE_RETRY;
+               goto out;
        }
        *len = rx_desc_array[next].length;
        memcpy(addr, rx_buffer_array[next], *len);
 
        rdt->rdt = (rdt->rdt + 1) % RXDESCS;
        next = (next + 1) % RXDESCS;
-       return 0;
+       r = 0;
+out:
+       spin_unlock(&e1000_lock);
+       return r;
 }
@@ -14,6 +14,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -22,8 +24,24 @@ static struct Env *env_free_list;	// Free environment list
 struct Thd *thds = NULL;
 static struct Thd *thd_free_list;
 
+struct EnvTabs *envtabs = NULL;
+
+// Protects the env and thread free lists and the growth of envs and
+// thds, each env's thread list, id generation and env_status.  Taken before any env_ipc_lock,
+// env_vm_lock or run queue lock.
+static struct spinlock env_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_lock"
+#endif
+};
+
+static int thd_free_locked(struct Thd *t);
+
 #define ENVGENSHIFT	12		// >= LOGNENV
-#define THDGENSHIFT 12
+#define THDGENSHIFT 13		// >= LOG2NTHD
+
+// Entries added to envs or thds each time one runs out
+#define ENV_GROW	64
 
 // Global descriptor table.
 //
@@ -92,6 +110,10 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= envtabs->et_nenv) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid) {
 		*env_store = 0;
@@ -112,6 +134,56 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Add up to ENV_GROW free environments to the end of 'envs' and insert
+// them into the env_free_list, which must be empty.  Returns 0 on
+// success, -E_NO_FREE_ENV if envs is full, or -E_NO_MEM.
+// env_lock must be held (or the other CPUs not started yet).
+static int
+env_grow(void)
+{
+	uint32_t n = envtabs->et_nenv, new_n = MIN(n + ENV_GROW, NENV);
+	int r;
+
+	if (n == NENV)
+		return -E_NO_FREE_ENV;
+	if ((r = pmap_map_envs(n * sizeof(struct Env),
+			       new_n * sizeof(struct Env))) < 0)
+		return r;
+	for(int i = new_n - 1; i >= (int) n; i--){
+		envs[i].env_id = 0;
+		envs[i].env_status = ENV_FREE;
+		__spin_initlock(&envs[i].env_vm_lock, "env_vm_lock");
+		__spin_initlock(&envs[i].env_ipc_lock, "env_ipc_lock");
+		envs[i].env_link = env_free_list;
+		env_free_list = &envs[i];
+	}
+	// Only now that the entries are mapped may envid2env look at them
+	envtabs->et_nenv = new_n;
+	return 0;
+}
+
+// Likewise for thds.
+static int
+thd_grow(void)
+{
+	uint32_t n = envtabs->et_nthd, new_n = MIN(n + ENV_GROW, NTHD);
+	int r;
+
+	if (n == NTHD)
+		return -E_NO_FREE_ENV;
+	if ((r = pmap_map_envs((char *) &thds[n] - (char *) envs,
+			       (char *) &thds[new_n] - (char *) envs)) < 0)
+		return r;
+	for(int i = new_n - 1; i >= (int) n; i--){
+		thds[i].thd_link = thd_free_list;
+		thds[i].thd_id = 0;
+		thds[i].thd_status = THD_FREE;
+		thd_free_list = &thds[i];
+	}
+	envtabs->et_nthd = new_n;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -119,25 +191,16 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 // env_alloc() returns envs[0]).
 // 初始化envs数组，构建env_free_list链表，使用头插法
 // 修改：还要初始化thds
+// envs and thds start with ENV_GROW entries each and grow on demand.
 void
 env_init(void)
 {
 	// Set up envs array
 	// LAB 3: Your code here.
 	env_free_list = NULL;
-	for(int i = NENV - 1; i >= 0; i--){
-		envs[i].env_id = 0;
-		envs[i].env_status = ENV_FREE;
-		envs[i].env_link = env_free_list;
-		env_free_list = &envs[i];
-	}
 	thd_free_list = NULL;
-	for(int i = NTHD - 1; i >= 0; i--){
-		thds[i].thd_link = thd_free_list;
-		thds[i].thd_id = 0;
-		thds[i].thd_status = THD_FREE;
-		thd_free_list = &thds[i];
-	}
+	if (env_grow() < 0 || thd_grow() < 0)
+		panic("env_init: out of memory");
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
@@ -227,22 +290,31 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	struct Env *e;
 	struct Thd *t;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	// Take e off the free list right away so that no other CPU can
+	// hand it out while we set it up.
+	spin_lock(&env_lock);
+	if (!env_free_list && (r = env_grow()) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	e = env_free_list;
+	env_free_list = e->env_link;
+	spin_unlock(&env_lock);
 	
 	e->env_thd_head = NULL;
 	e->env_thd_tail = NULL;
 
 	if ((r = thd_alloc(&t, e)) < 0)
-		return r;
+		goto fail;
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0) {
 		thd_free(t);
-		return r;
+		goto fail;
 	}
 
 	// Generate an env_id for this environment.
+	spin_lock(&env_lock);
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
 	if (generation <= 0)	// Don't create a negative env_id.
 		generation = 1 << ENVGENSHIFT;
@@ -252,9 +324,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
+	spin_unlock(&env_lock);
 
-	// 注释掉Env中放弃的字段
-	// e->env_runs = 0;
+	// Accounting totals of exited threads
+	e->env_runtime = 0;
+	e->env_wait_time = 0;
+	e->env_runs = 0;
+	e->env_migrations = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -284,15 +360,25 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
-	e->env_ipc_recving = 0;
+	// No threads receiving yet.
+	e->env_ipc_recv_head = e->env_ipc_recv_tail = NULL;
+	e->env_ipc_mbox = NULL;
+	e->env_ipc_queued = 0;
+	e->env_ipc_nqueued = 0;
+	e->env_ipc_nblocked = 0;
+	e->env_ipc_ndropped = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
+
+fail:
+	spin_lock(&env_lock);
+	e->env_link = env_free_list;
+	env_free_list = e;
+	spin_unlock(&env_lock);
+	return r;
 }
 
 //
@@ -380,21 +466,29 @@ load_icode(struct Env *e, uint8_t *binary)
 	struct Elf * ELF = (struct Elf *) binary;
 	struct Proghdr * ph;
 	int ph_num;
+	uintptr_t va, bss;
 	if(ELF->e_magic != ELF_MAGIC){ // 判断格式是否是ELF
 		panic("Binary is not ELF format! \n");
 	}
 
 	ph = (struct Proghdr *) ((uint8_t *)ELF + ELF->e_phoff); // ph是程序头距离ELF的偏移
 	ph_num = ELF->e_phnum;
-	lcr3(PADDR(e->env_pgdir)); // 切换到当前用户环境的页目录表
+	pmap_switch(e->env_pgdir); // 切换到当前用户环境的页目录表
 	for(int i = 0; i < ph_num; i++){
 		if(ph[i].p_type == ELF_PROG_LOAD){ // 只加载Load类型的Segment
 			if (ph->p_filesz > ph->p_memsz) {
                 panic("load_icode: file size is greater than memory size");
             }
-			region_alloc(e, (void*)ph[i].p_va, ph[i].p_memsz); // 给每个Segment分配物理空间
-			memset((void*)ph[i].p_va, 0, ph[i].p_memsz);
-			memcpy((void*)ph[i].p_va, binary + ph[i].p_offset, ph[i].p_filesz);
+			// Pages that hold none of the file are demand-zero
+			va = ph[i].p_va;
+			bss = MIN(ROUNDUP(va + ph[i].p_filesz, PGSIZE), va + ph[i].p_memsz);
+			region_alloc(e, (void*)va, bss - va); // 给每个Segment分配物理空间
+			memset((void*)va, 0, bss - va);
+			memcpy((void*)va, binary + ph[i].p_offset, ph[i].p_filesz);
+			if (page_reserve(e->env_pgdir, (void*)ROUNDUP(bss, PGSIZE),
+					 ROUNDUP(va + ph[i].p_memsz, PGSIZE) - ROUNDUP(bss, PGSIZE),
+					 PTE_P | PTE_U | PTE_W) < 0)
+				panic("load_icode: out of memory for the bss");
 		}
 	}
 	// e->env_tf.tf_eip = ELF->e_entry; // EIP指向程序入口
@@ -406,7 +500,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	// LAB 3: Your code here.
 	// 分配初始栈空间
 	region_alloc(e, (void*)(USTACKTOP - PGSIZE), PGSIZE);
-	lcr3(PADDR(kern_pgdir)); // 切换回系统的页目录表
+	pmap_switch(NULL); // 切换回系统的页目录表
 }
 
 //
@@ -435,7 +529,10 @@ env_create(uint8_t *binary, enum EnvType type)
 		}
 	}
 	e->env_type = type;
+	if (type != ENV_TYPE_USER)
+		e->env_thd_head->thd_priority = THD_PRIO_SERVER;
 	load_icode(e, binary);
+	sched_enqueue(e->env_thd_head);
 }
 
 //
@@ -448,15 +545,20 @@ env_free(struct Env *e)
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+	// Make sure no CPU (including this one, if freeing the current
+	// environment) still has the page directory loaded before freeing
+	// it, just in case the page gets reused.
+	if (e->env_pgdir)
+		pmap_wait_unloaded(e->env_pgdir);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Anyone still looking at the address space (a syscall on another
+	// CPU that looked e up before it died) holds env_vm_lock and notices
+	// env_pgdir going away once it gets the lock.
+	spin_lock(&e->env_vm_lock);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -465,6 +567,12 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -484,11 +592,70 @@ env_free(struct Env *e)
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	spin_unlock(&e->env_vm_lock);
+
+	// Senders notice env_pgdir gone and leave the mailbox alone
+	ipc_env_free(e);
 
 	// return the environment to the free list
+	spin_lock(&env_lock);
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_lock);
+}
+
+//
+// Set e's status to ENV_RUNNABLE or ENV_NOT_RUNNABLE and put its
+// runnable threads on, or take them off, the run queues.
+//
+int
+env_set_status(struct Env *e, int status)
+{
+	struct Thd *t;
+
+	spin_lock(&env_lock);
+	if (e->env_status == ENV_DYING || e->env_status == ENV_FREE) {
+		spin_unlock(&env_lock);
+		return -E_BAD_ENV;
+	}
+	e->env_status = status;
+	for (t = e->env_thd_head; t != NULL; t = t->thd_next) {
+		if (status == ENV_RUNNABLE)
+			sched_enqueue(t);
+		else
+			sched_dequeue(t);
+	}
+	spin_unlock(&env_lock);
+	return 0;
+}
+
+//
+// Lock the address spaces of a and b, which may be the same env, in a
+// consistent order.  Returns -E_BAD_ENV, with nothing locked, if either
+// env was freed after the caller looked it up.
+//
+int
+env_lock_vm(struct Env *a, struct Env *b)
+{
+	struct Env *lo = a < b ? a : b, *hi = a < b ? b : a;
+
+	spin_lock(&lo->env_vm_lock);
+	if (hi != lo)
+		spin_lock(&hi->env_vm_lock);
+	if (!a->env_pgdir || !b->env_pgdir) {
+		env_unlock_vm(a, b);
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+void
+env_unlock_vm(struct Env *a, struct Env *b)
+{
+	if (a != b)
+		spin_unlock(&b->env_vm_lock);
+	spin_unlock(&a->env_vm_lock);
 }
 
 //
@@ -502,27 +669,31 @@ env_destroy(struct Env *e)
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	struct Thd *t;
-	
-	for (t = e->env_thd_head; t != NULL; t = t->thd_next) {
-		if (t->thd_status == THD_RUNNING && curthd != t) {
-			t->thd_status = THD_DYING;
-		}
-		else {
-			thd_free(t);
-		}
+	struct Thd *t, *next;
+	bool last;
+
+	spin_lock(&env_lock);
+	if (e->env_status == ENV_FREE) {
+		// Someone else got here first
+		spin_unlock(&env_lock);
+		goto out;
 	}
-
-	if (e->env_thd_head != NULL) {
-		e->env_status = ENV_DYING;
-	}
-	else {
-		env_free(e);
+	e->env_status = ENV_DYING;
+	for (t = e->env_thd_head; t != NULL; t = next) {
+		next = t->thd_next;
+		if (t->thd_status != THD_DYING)
+			thd_free_locked(t);
 	}
+	// The threads left are running on other CPUs; the last of them
+	// to trap into the kernel frees the env.
+	last = (e->env_thd_head == NULL);
+	spin_unlock(&env_lock);
 
-	//env_free(e);
+	if (last)
+		env_free(e);
 
-	if (curthd->thd_env == e) {
+out:
+	if (curthd && curthd->thd_env == e) {
 		curthd = NULL;
 		sched_yield();
 	}
@@ -579,15 +750,10 @@ thd_run(struct Thd *t)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if(curthd != NULL && curthd->thd_status == THD_RUNNING){ //如果当前有运行的Thd，则挂起
-		curthd->thd_status = THD_RUNNABLE;
-	}
-	curthd = t;
-	t->thd_status = THD_RUNNING;
-	if (curthd != t) t->thd_runs++;
-	lcr3(PADDR(t->thd_env->env_pgdir)); // 加载当前Thd的线性地址到分页寄存器
-	// Lab4: 释放内核
-	unlock_kernel();
+	// sched_yield has already made t curthd and marked it THD_RUNNING
+	// under this CPU's run queue lock.  Switching between threads of
+	// the same environment keeps the address space and its TLB entries.
+	pmap_switch(t->thd_env->env_pgdir); // 加载当前Thd的线性地址到分页寄存器
 	thd_pop_tf(&t->thd_tf); // 从栈中取tf结构
 }
 
@@ -597,8 +763,17 @@ int thd_alloc(struct Thd **newthd_store, struct Env *env) {
 	int r;
 	struct Thd *t;
 	
-	if (!(t = thd_free_list))
-		return -E_NO_FREE_ENV;
+	spin_lock(&env_lock);
+	// No new threads in an env that is being torn down
+	if (env->env_status == ENV_DYING) {
+		spin_unlock(&env_lock);
+		return -E_BAD_ENV;
+	}
+	if (!thd_free_list && (r = thd_grow()) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	t = thd_free_list;
 
 	generation = (t->thd_id + (1 << THDGENSHIFT)) & ~(NTHD - 1);
 	if (generation <= 0)
@@ -608,7 +783,24 @@ int thd_alloc(struct Thd **newthd_store, struct Env *env) {
 	t->thd_env = env;
 	t->thd_status = THD_RUNNABLE;
 	t->thd_runs = 0;
+	// Servers get a bigger share of the CPU than their clients
+	t->thd_priority = env->env_type == ENV_TYPE_USER ?
+			  THD_PRIO_DEFAULT : THD_PRIO_SERVER;
+	t->thd_runtime = 0;
+	t->thd_vruntime = 0;
 	t->thd_uxstack = UXSTACKTOP;
+	// Start out on the creating CPU's run queue
+	t->thd_cpunum = cpunum();
+	t->thd_affinity = ~0;
+	t->thd_migrations = 0;
+	t->thd_last_ran = 0;
+	t->thd_wait_time = 0;
+	t->thd_sleep_futex = 0;
+	t->thd_futex_key = 0;
+	t->thd_futex_prev = t->thd_futex_next = NULL;
+	t->thd_ipc_recving = 0;
+	t->thd_ipc_to = NULL;
+	t->thd_rq_cpu = -1;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -646,14 +838,41 @@ int thd_alloc(struct Thd **newthd_store, struct Env *env) {
 	}
 
 	thd_free_list = t->thd_link;
+	spin_unlock(&env_lock);
 	*newthd_store = t;
 	return 0;
 }
 
-void thd_free(struct Thd *t) {
+// Free thread t, or if it is running on another CPU, mark it THD_DYING
+// for that CPU to free.  Returns 1 if t was the last thread of its env,
+// in which case the caller should env_free the env.
+int thd_free(struct Thd *t) {
+	int r;
+
+	spin_lock(&env_lock);
+	r = thd_free_locked(t);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// thd_free with env_lock held.
+static int thd_free_locked(struct Thd *t) {
+	struct Env *e = t->thd_env;
+	struct PageInfo *pp;
+
 	assert(t->thd_status != THD_FREE);
-	
-	t->thd_status = THD_FREE;
+
+	if (!sched_detach(t))
+		return 0;
+	sched_cancel_sleep(t);
+	futex_cancel(t);
+	ipc_cancel(t);
+
+	// Keep its share of the env's accounting
+	e->env_runtime += t->thd_runtime;
+	e->env_wait_time += t->thd_wait_time;
+	e->env_runs += t->thd_runs;
+	e->env_migrations += t->thd_migrations;
 
 	if (t->thd_prev)
 		t->thd_prev->thd_next = t->thd_next;
@@ -666,18 +885,19 @@ void thd_free(struct Thd *t) {
 
 	t->thd_link = thd_free_list;
 	thd_free_list = t;
+	// Threads in wait_thread wait on the (read-only) thd_status.  thds[]
+	// lives at KENVS, below KERNBASE, so name the futex by the page
+	// behind that mapping, as futex_key does through UTHDS.
+	pp = page_lookup(kern_pgdir, (void *) &t->thd_status, NULL);
+	futex_wake(page2pa(pp) + PGOFF(&t->thd_status), NTHD);
+	return e->env_thd_head == NULL;
 }
 
 void thd_destroy(struct Thd *t) {
-	if (t->thd_status == THD_RUNNING && curthd != t) {
-		t->thd_status = THD_DYING;
-		return;
-	}
+	struct Env *e = t->thd_env;
 
-	thd_free(t);
-
-	if (t->thd_env->env_thd_head == NULL)
-		env_free(t->thd_env);
+	if (thd_free(t))
+		env_free(e);
 
 	if (curthd == t) {
 		curthd = NULL;
@@ -693,7 +913,11 @@ int thdid2thd(thdid_t thdid, struct Thd **thd_store, bool checkperm) {
 		return 0;
 	}
 
-	t = &thds[ENVX(thdid)];
+	if (THDX(thdid) >= envtabs->et_nthd) {
+		*thd_store = 0;
+		return -E_BAD_ENV;
+	}
+	t = &thds[THDX(thdid)];
 	if (t->thd_status == THD_FREE || t->thd_id != thdid) {
 		*thd_store = 0;
 		return -E_BAD_ENV;
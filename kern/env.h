@@ -8,6 +8,7 @@
 
 extern struct Env *envs;		// All environments
 extern struct Thd *thds;
+extern struct EnvTabs *envtabs;		// How much of envs and thds exists
 #define curthd (thiscpu->cpu_thd)		// Current environment
 #define curenv (curthd ? curthd->thd_env : NULL)	// Current environment
 extern struct Segdesc gdt[];
@@ -18,8 +19,11 @@ int		env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+int	env_set_status(struct Env *e, int status);
+int	env_lock_vm(struct Env *a, struct Env *b);
+void	env_unlock_vm(struct Env *a, struct Env *b);
 int		thd_alloc(struct Thd **newthd_store, struct Env *env);
-void	thd_free(struct Thd *t);
+int		thd_free(struct Thd *t);
 void	thd_destroy(struct Thd *t);
 int thdid2thd(thdid_t thdid, struct Thd **thd_store, bool checkperm);
 
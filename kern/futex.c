@@ -0,0 +1,191 @@
+// Futexes: wait queues that user threads can block on until another
+// thread changes a word of memory and says so.
+//
+// A futex is named by the physical address of the word, so every env
+// that maps the page (a PTE_SHARE page, say) names the same futex no
+// matter where it maps it.  Waiting threads hang off one of a fixed
+// number of hash buckets, each with its own lock, in arrival order.
+//
+// A timed wait also puts the thread on the scheduler's sleep queue.
+// Whoever takes the thread off the bucket wakes it: futex_wake, which
+// also cancels the sleep, or futex_timeout, which the scheduler calls
+// once the deadline passes.  Bucket locks are taken before sleep_lock
+// and the run queue locks.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/futex.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+#define FUTEX_HASH_BITS		6
+
+static struct FutexBucket {
+	struct spinlock lock;
+	struct Thd *head;		// Linked by thd_futex_next
+	struct Thd *tail;
+} futex_buckets[1 << FUTEX_HASH_BITS];
+
+static struct FutexBucket *
+futex_bucket(physaddr_t key)
+{
+	return &futex_buckets[((key >> 2) * 2654435761u) >>
+			      (32 - FUTEX_HASH_BITS)];
+}
+
+void
+futex_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(futex_buckets); i++)
+		__spin_initlock(&futex_buckets[i].lock, "futex_lock");
+}
+
+// Take t off bucket b.  b must be locked.
+static void
+futex_remove(struct FutexBucket *b, struct Thd *t)
+{
+	if (t->thd_futex_prev)
+		t->thd_futex_prev->thd_futex_next = t->thd_futex_next;
+	else
+		b->head = t->thd_futex_next;
+	if (t->thd_futex_next)
+		t->thd_futex_next->thd_futex_prev = t->thd_futex_prev;
+	else
+		b->tail = t->thd_futex_prev;
+	t->thd_futex_prev = t->thd_futex_next = NULL;
+	t->thd_futex_key = 0;
+}
+
+// Find the futex for the word at va in e's address space.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not aligned or not mapped user-readable in e.
+//	-E_BAD_ENV if e is being freed.
+int
+futex_key(struct Env *e, const void *va, physaddr_t *key)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) va % sizeof(uint32_t))
+		return -E_INVAL;
+	if ((r = env_lock_vm(e, e)) < 0)
+		return r;
+	// A word in a copy-on-write or untouched demand-zero page is named
+	// by the page it will live in once written, not by the page it
+	// shares for now.
+	page_user_fault(e->env_pgdir, (void *) va, 1);
+	if (user_mem_check(e, va, sizeof(uint32_t), PTE_U) < 0 ||
+	    (pp = page_lookup(e->env_pgdir, (void *) va, &pte)) == NULL)
+		r = -E_INVAL;
+	else if (*pte & PTE_PS)
+		*key = page2pa(pp) + ((uintptr_t) va & (PTSIZE - 1));
+	else
+		*key = page2pa(pp) + PGOFF(va);
+	env_unlock_vm(e, e);
+	return r;
+}
+
+// Block t on futex key, for at most msec milliseconds if msec is not 0,
+// unless the word no longer holds val.  Returns 0 if t is now blocked,
+// in which case the caller should give up the CPU; the syscall returns
+// 0 when woken and -E_TIMEOUT when the time is up.  Returns -E_AGAIN if
+// the word has changed.
+int
+futex_wait(struct Thd *t, physaddr_t key, uint32_t val, uint32_t msec)
+{
+	struct FutexBucket *b = futex_bucket(key);
+
+	// Holding the bucket lock across the check means that a waker
+	// that changes the word and then calls futex_wake either finds
+	// us on the queue or makes us return -E_AGAIN.
+	spin_lock(&b->lock);
+	if (*(volatile uint32_t *) KADDR(key) != val) {
+		spin_unlock(&b->lock);
+		return -E_AGAIN;
+	}
+
+	t->thd_futex_key = key;
+	t->thd_futex_seq++;
+	t->thd_futex_next = NULL;
+	t->thd_futex_prev = b->tail;
+	if (b->tail)
+		b->tail->thd_futex_next = t;
+	else
+		b->head = t;
+	b->tail = t;
+
+	// The thread leaves the kernel through sched_yield, so set the
+	// result up front; futex_wake changes it.
+	t->thd_tf.tf_regs.reg_eax = msec ? -E_TIMEOUT : 0;
+	sched_block(t);
+	if (msec)
+		sched_sleep(t, msec, 1);
+	spin_unlock(&b->lock);
+	return 0;
+}
+
+// Wake up to n threads waiting on futex key, oldest first.
+// Returns the number woken.
+int
+futex_wake(physaddr_t key, int n)
+{
+	struct FutexBucket *b = futex_bucket(key);
+	struct Thd *t, *next;
+	int woken = 0;
+
+	spin_lock(&b->lock);
+	for (t = b->head; t && woken < n; t = next) {
+		next = t->thd_futex_next;
+		if (t->thd_futex_key != key)
+			continue;
+		futex_remove(b, t);
+		t->thd_tf.tf_regs.reg_eax = 0;
+		sched_cancel_sleep(t);
+		sched_wakeup(t);
+		woken++;
+	}
+	spin_unlock(&b->lock);
+	return woken;
+}
+
+// The timed wait of thread t, whose thd_futex_seq was seq when the
+// scheduler took it off the sleep queue, has run out.  t may since have
+// been woken and be waiting again, or even have been freed and reused.
+void
+futex_timeout(struct Thd *t, uint32_t seq)
+{
+	physaddr_t key = t->thd_futex_key;
+	struct FutexBucket *b;
+
+	if (!key)
+		return;
+	b = futex_bucket(key);
+	spin_lock(&b->lock);
+	if (t->thd_futex_key == key && t->thd_futex_seq == seq) {
+		futex_remove(b, t);
+		sched_wakeup(t);
+	}
+	spin_unlock(&b->lock);
+}
+
+// Take t off any futex it waits on, without waking it.
+void
+futex_cancel(struct Thd *t)
+{
+	physaddr_t key = t->thd_futex_key;
+	struct FutexBucket *b;
+
+	if (!key)
+		return;
+	b = futex_bucket(key);
+	spin_lock(&b->lock);
+	if (t->thd_futex_key == key)
+		futex_remove(b, t);
+	spin_unlock(&b->lock);
+}
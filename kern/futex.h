@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void futex_init(void);
+int futex_key(struct Env *e, const void *va, physaddr_t *key);
+int futex_wait(struct Thd *t, physaddr_t key, uint32_t val, uint32_t msec);
+int futex_wake(physaddr_t key, int n);
+void futex_timeout(struct Thd *t, uint32_t seq);
+void futex_cancel(struct Thd *t);
+
+#endif	// !JOS_KERN_FUTEX_H
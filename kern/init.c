@@ -16,9 +16,16 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/futex.h>
+#include <kern/kmalloc.h>
 
 static void boot_aps(void);
 
+// Set once the BSP has created the first environments.  Until then the
+// APs must stay out of the scheduler, which would otherwise find nothing
+// to run and drop into the monitor.
+static volatile uint32_t sched_started;
+
 
 void
 i386_init(void)
@@ -31,6 +38,7 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -38,6 +46,8 @@ i386_init(void)
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
+	sched_init();
+	futex_init();
 	lapic_init();
 
 	// Lab 4 multitasking initialization functions
@@ -47,10 +57,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
 	// Starting non-boot CPUs
 	boot_aps();
 
@@ -74,6 +80,7 @@ i386_init(void)
 	// kbd_intr();
 
 	// Schedule and run the first user environment!
+	xchg(&sched_started, 1);
 	sched_yield();
 }
 
@@ -114,6 +121,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	// kern_pgdir maps KERNBASE with 4MB pages, so turn on PSE first
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -123,11 +132,10 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.  The scheduler locks
+	// its own run queues, so several CPUs may enter it at once.
+	while (!sched_started)
+		asm volatile("pause");
 
 	// Remove this after you finish Exercise 6
 	//for (;;);
@@ -0,0 +1,547 @@
+// Kernel-buffered IPC.
+//
+// Every thread receives for itself: a thread in sys_ipc_recv waits on
+// its env's list of receivers with its own dstva, and the message lands
+// in its own thd_ipc_* fields.  A send names either an env, and goes to
+// the thread that has been waiting longest, or one thread of it (see
+// IPC_THD), so that a server can run several threads that each wait
+// for requests and reply to the very thread that asked.
+//
+// A send that finds no thread waiting for it lands in the env's
+// mailbox, a ring of IPC_QLEN messages allocated the first time it is
+// needed, and the next sys_ipc_recv by a thread it may go to takes it
+// from there without blocking.  A sent page is looked up and referenced
+// at send time, so the sender may unmap it right away; it is mapped at
+// the receiver's dstva only when the message is received.
+//
+// When the mailbox is full, a blocking send (sys_ipc_send) hangs the
+// sending thread, message and all, off the mailbox in arrival order,
+// and each receive that frees a slot moves the oldest of them into it
+// and wakes it.  A non-blocking send (sys_ipc_try_send) fails with
+// -E_IPC_NOT_RECV instead.  The counts of queued, blocked and refused
+// sends are kept in envs[] for the monitor's ipc command.
+//
+// A message never waits, in the mailbox or with a blocked sender, while
+// a thread it may go to is waiting: sends look for a receiver first,
+// and receives look at the mailbox and blocked senders first.
+//
+// Besides its value, a message carries IPC_NWORDS words, which a sender
+// passes with IPC_WORDS in place of a page, and the receiving thread
+// gets back in registers along with the value, so that small requests
+// and replies need neither a page mapping nor a look at thisthd.
+//
+// sys_ipc_call sends and then receives in one trap, and
+// sys_ipc_reply_wait does the same the other way round for servers.
+// When the send goes straight to a receiving thread and the sender then
+// blocks, the sender's CPU switches to the receiver directly
+// (sched_handoff), so a request and its reply each take one trap and
+// no trip through the run queue.
+//
+// Everything here is protected by the receiver's env_ipc_lock, which is
+// taken before any env_vm_lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+
+#include <kern/ipc.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/kmalloc.h>
+#include <kern/spinlock.h>
+
+#define IPC_QLEN	16
+
+struct IpcMsg {
+	thdid_t to;			// Receiving thread, or 0 for any
+	envid_t from;
+	thdid_t from_thd;
+	uint32_t value;
+	uint32_t words[IPC_NWORDS];
+	struct PageInfo *pp;		// Referenced page, or NULL
+	int perm;
+};
+
+struct IpcMbox {
+	struct IpcMsg msgs[IPC_QLEN];
+	int head;			// Oldest message
+	int count;
+	struct Thd *send_head;		// Blocked senders, by thd_ipc_next
+	struct Thd *send_tail;
+};
+
+// May a message for thread 'to' go to thread t?
+static bool
+ipc_match(thdid_t to, struct Thd *t)
+{
+	return !to || to == t->thd_id;
+}
+
+// Append t to the list head..tail, linked by thd_ipc_next.
+static void
+ipc_append(struct Thd **head, struct Thd **tail, struct Thd *t)
+{
+	t->thd_ipc_next = NULL;
+	if (*tail)
+		(*tail)->thd_ipc_next = t;
+	else
+		*head = t;
+	*tail = t;
+}
+
+// Take t off the list head..tail, which it must be on.
+static void
+ipc_unlink(struct Thd **head, struct Thd **tail, struct Thd *t)
+{
+	struct Thd **pt, *prev = NULL;
+
+	for (pt = head; *pt != t; pt = &(*pt)->thd_ipc_next)
+		prev = *pt;
+	*pt = t->thd_ipc_next;
+	if (*tail == t)
+		*tail = prev;
+	t->thd_ipc_next = NULL;
+}
+
+// Look up the page the current env sends at srcva with perm, and take
+// a reference to it.  Stores NULL if srcva is not below UTOP.
+// Errors are as for sys_ipc_try_send.
+static int
+ipc_page(void *srcva, unsigned perm, struct PageInfo **pp_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	*pp_store = NULL;
+	if ((uintptr_t) srcva >= UTOP)
+		return 0;
+	if (PGOFF(srcva))
+		return -E_INVAL;
+	if ((r = env_lock_vm(curenv, curenv)) < 0)
+		return r;
+	pp = page_lookup(curenv->env_pgdir, srcva, &pte);
+	// An untouched demand-zero page gets its memory now
+	if (!pp && page_user_fault(curenv->env_pgdir, srcva, perm & PTE_W) == 0)
+		pp = page_lookup(curenv->env_pgdir, srcva, &pte);
+
+	//按照注释的顺序进行判定
+	if (!pp) r = -E_INVAL; //srcva还没有映射到物理页
+	else if (*pte & PTE_PS) r = -E_INVAL; //只能传递4KB的页
+	else if ((*pte & perm & 7) != (perm & 7)) r = -E_INVAL; //perm应该是*pte的子集
+	else if ((perm & PTE_W) && !(*pte & PTE_W)) r = -E_INVAL; //写权限
+	else {
+		page_incref(pp);
+		*pp_store = pp;
+	}
+	env_unlock_vm(curenv, curenv);
+	return r;
+}
+
+// Copy the IPC_NWORDS words the current env sends at srcva into words.
+// Errors are as for sys_ipc_try_send.
+static int
+ipc_words(const void *srcva, uint32_t *words)
+{
+	int r;
+
+	if ((r = env_lock_vm(curenv, curenv)) < 0)
+		return r;
+	if (user_mem_check(curenv, srcva, IPC_NWORDS * sizeof(uint32_t),
+			   PTE_U) < 0)
+		r = -E_INVAL;
+	else
+		memcpy(words, srcva, IPC_NWORDS * sizeof(uint32_t));
+	env_unlock_vm(curenv, curenv);
+	return r;
+}
+
+// Fill in what the current env sends at srcva with perm in *m: the
+// words there if perm has IPC_WORDS, else the page, if any.
+static int
+ipc_payload(void *srcva, unsigned perm, struct IpcMsg *m)
+{
+	memset(m->words, 0, sizeof(m->words));
+	if (perm & IPC_WORDS) {
+		m->pp = NULL;
+		m->perm = 0;
+		return ipc_words(srcva, m->words);
+	}
+	m->perm = perm;
+	return ipc_page(srcva, perm, &m->pp);
+}
+
+// Hand message m to thread t, which is receiving or taking it from the
+// mailbox.  The page, if any, is mapped at t's thd_ipc_dstva if t asked
+// for one; the caller keeps its own reference to it.
+static int
+ipc_deliver(struct Thd *t, const struct IpcMsg *m)
+{
+	struct Env *e = t->thd_env;
+	int r;
+
+	t->thd_ipc_perm = 0;
+	if (m->pp && t->thd_ipc_dstva < (void *) UTOP) {
+		if ((r = env_lock_vm(e, e)) < 0)
+			return r;
+		r = page_insert(e->env_pgdir, m->pp, t->thd_ipc_dstva, m->perm); //共享相同的映射关系
+		env_unlock_vm(e, e);
+		if (r < 0)
+			return r;
+		t->thd_ipc_perm = m->perm;
+	}
+	t->thd_ipc_from = m->from;
+	t->thd_ipc_from_thd = m->from_thd;
+	t->thd_ipc_value = m->value;
+	memcpy(t->thd_ipc_words, m->words, sizeof(m->words));
+
+	// t returns to user space with the message in the registers it
+	// passed the arguments in, eax aside
+	static_assert(IPC_NWORDS == 4);
+	t->thd_tf.tf_regs.reg_edx = m->value;
+	t->thd_tf.tf_regs.reg_ecx = m->words[0];
+	t->thd_tf.tf_regs.reg_ebx = m->words[1];
+	t->thd_tf.tf_regs.reg_edi = m->words[2];
+	t->thd_tf.tf_regs.reg_esi = m->words[3];
+	return 0;
+}
+
+// Take the message of blocked sender s off mailbox mb into *m, and wake
+// s, whose send is done.
+static void
+ipc_take_sender(struct IpcMbox *mb, struct Thd *s, struct IpcMsg *m)
+{
+	ipc_unlink(&mb->send_head, &mb->send_tail, s);
+	m->to = s->thd_ipc_out_thd;
+	m->from = s->thd_env->env_id;
+	m->from_thd = s->thd_id;
+	m->value = s->thd_ipc_out_value;
+	memcpy(m->words, s->thd_ipc_out_words, sizeof(m->words));
+	m->pp = s->thd_ipc_out_pp;
+	m->perm = s->thd_ipc_out_perm;
+	s->thd_ipc_to = NULL;
+	s->thd_ipc_out_pp = NULL;
+	sched_wakeup(s);
+}
+
+// Remove the i'th oldest message from mailbox mb into *m.
+static void
+ipc_take(struct IpcMbox *mb, int i, struct IpcMsg *m)
+{
+	*m = mb->msgs[(mb->head + i) % IPC_QLEN];
+	for (; i > 0; i--)
+		mb->msgs[(mb->head + i) % IPC_QLEN] =
+			mb->msgs[(mb->head + i - 1) % IPC_QLEN];
+	mb->head = (mb->head + 1) % IPC_QLEN;
+	mb->count--;
+}
+
+// Move the oldest blocked senders of e into free slots of its mailbox.
+static void
+ipc_refill(struct Env *e, struct IpcMbox *mb)
+{
+	while (mb->count < IPC_QLEN && mb->send_head)
+		ipc_take_sender(mb, mb->send_head,
+				&mb->msgs[(mb->head + mb->count++) % IPC_QLEN]);
+	e->env_ipc_queued = mb->count;
+}
+
+// Send value, and the page at srcva if srcva is below UTOP or the words
+// there if perm has IPC_WORDS, from thread t of the current env to env e: to its thread 'to', or if 'to' is 0,
+// to any of its threads.  If e's mailbox is full and block is set, t
+// blocks until there is room: returns 1, and the caller should give up
+// the CPU; the syscall returns 0 once the message is queued.
+// Otherwise returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, where -E_IPC_NOT_RECV means that the mailbox is full.
+//
+// If wake_store is not NULL, a receiving thread that the message went
+// straight to is stored there for the caller to wake or hand the CPU
+// to, rather than woken; otherwise NULL is stored.
+int
+ipc_send(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+	 void *srcva, unsigned perm, bool block, struct Thd **wake_store)
+{
+	struct IpcMbox *mb;
+	struct IpcMsg m;
+	struct Thd *rt;
+	int r;
+
+	if (wake_store)
+		*wake_store = NULL;
+	if ((r = ipc_payload(srcva, perm, &m)) < 0)
+		return r;
+	m.to = to;
+	m.from = t->thd_env->env_id;
+	m.from_thd = t->thd_id;
+	m.value = value;
+
+	// The receiver's ipc lock keeps other senders out until we are done.
+	spin_lock(&e->env_ipc_lock);
+	if (!e->env_pgdir) {
+		// e is being freed
+		r = -E_BAD_ENV;
+		goto out;
+	}
+	if (to) {
+		// ipc_cancel drops what is left for a thread that is freed
+		rt = &thds[THDX(to)];
+		if (rt->thd_id != to || rt->thd_env != e ||
+		    rt->thd_status == THD_FREE || rt->thd_status == THD_DYING) {
+			r = -E_BAD_ENV;
+			goto out;
+		}
+	}
+
+	for (rt = e->env_ipc_recv_head; rt; rt = rt->thd_ipc_next)
+		if (ipc_match(to, rt))
+			break;
+	if (rt) {
+		if ((r = ipc_deliver(rt, &m)) < 0)
+			goto out;
+		ipc_unlink(&e->env_ipc_recv_head, &e->env_ipc_recv_tail, rt);
+		rt->thd_ipc_recving = 0;
+		rt->thd_tf.tf_regs.reg_eax = 0;
+		if (wake_store)
+			*wake_store = rt;
+		else
+			sched_wakeup(rt);
+		goto out;
+	}
+
+	if (!e->env_ipc_mbox &&
+	    !(e->env_ipc_mbox = kmalloc(sizeof(struct IpcMbox), ALLOC_ZERO))) {
+		r = -E_NO_MEM;
+		goto out;
+	}
+	mb = e->env_ipc_mbox;
+	if (mb->count < IPC_QLEN) {
+		mb->msgs[(mb->head + mb->count++) % IPC_QLEN] = m;
+		m.pp = NULL;
+		e->env_ipc_queued = mb->count;
+		e->env_ipc_nqueued++;
+	} else if (block) {
+		t->thd_ipc_to = e;
+		t->thd_ipc_out_thd = to;
+		t->thd_ipc_out_value = value;
+		memcpy(t->thd_ipc_out_words, m.words, sizeof(m.words));
+		t->thd_ipc_out_pp = m.pp;
+		t->thd_ipc_out_perm = m.perm;
+		m.pp = NULL;
+		ipc_append(&mb->send_head, &mb->send_tail, t);
+		e->env_ipc_nblocked++;
+		// ipc_take_sender leaves the result alone
+		t->thd_tf.tf_regs.reg_eax = 0;
+		sched_block(t);
+		r = 1;
+	} else {
+		e->env_ipc_ndropped++;
+		r = -E_IPC_NOT_RECV;
+	}
+out:
+	spin_unlock(&e->env_ipc_lock);
+	if (m.pp)
+		page_decref(m.pp);
+	return r;
+}
+
+// Receive a message in thread t of the current env, with a page mapped
+// at dstva if dstva is below UTOP.  Returns 0 if a waiting message was
+// received, or 1 if t is now blocked until a sender comes along, in
+// which case the caller should give up the CPU.
+int
+ipc_recv(struct Thd *t, void *dstva)
+{
+	struct Env *e = t->thd_env;
+	struct IpcMbox *mb;
+	struct IpcMsg m;
+	struct Thd *s = NULL;
+	int i = 0;
+
+	spin_lock(&e->env_ipc_lock);
+	t->thd_ipc_dstva = dstva;
+	if ((mb = e->env_ipc_mbox) != NULL) {
+		for (i = 0; i < mb->count; i++)
+			if (ipc_match(mb->msgs[(mb->head + i) % IPC_QLEN].to, t))
+				break;
+		// Only a full mailbox has blocked senders
+		if (i == mb->count)
+			for (s = mb->send_head; s; s = s->thd_ipc_next)
+				if (ipc_match(s->thd_ipc_out_thd, t))
+					break;
+	}
+	if (!mb || (i == mb->count && !s)) {
+		// Block before a sender can see thd_ipc_recving, so that
+		// its wakeup can't be lost.
+		t->thd_ipc_recving = 1;
+		ipc_append(&e->env_ipc_recv_head, &e->env_ipc_recv_tail, t);
+		sched_block(t);
+		spin_unlock(&e->env_ipc_lock);
+		return 1;
+	}
+
+	if (s)
+		ipc_take_sender(mb, s, &m);
+	else {
+		ipc_take(mb, i, &m);
+		ipc_refill(e, mb);
+	}
+
+	// The message is received even if its page can't be mapped;
+	// thd_ipc_perm says whether it was.
+	if (ipc_deliver(t, &m) < 0) {
+		struct IpcMsg nopage = m;
+
+		nopage.pp = NULL;
+		ipc_deliver(t, &nopage);
+	}
+	spin_unlock(&e->env_ipc_lock);
+	if (m.pp)
+		page_decref(m.pp);
+	return 0;
+}
+
+// Receive for ipc_call and ipc_reply_wait, with *next_store the thread
+// the send just went to, if any.  Unless t blocks, that thread is woken
+// here and no longer needs a handoff.
+static int
+ipc_wait(struct Thd *t, void *dstva, struct Thd **next_store)
+{
+	int r;
+
+	if ((r = ipc_recv(t, dstva)) == 1 || !*next_store)
+		return r;
+	sched_wakeup(*next_store);
+	*next_store = NULL;
+	return r;
+}
+
+// Send a message from t to e as a non-blocking ipc_send does, and then
+// receive one as ipc_recv does.  Returns 0 or 1 as ipc_recv does, or
+// < 0 if the send fails, in which case nothing is received.  If t
+// blocks and the message went straight to a receiving thread, that
+// thread is stored in *next_store for the caller to hand the CPU to;
+// otherwise NULL is stored.
+int
+ipc_call(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+	 void *srcva, unsigned perm, void *dstva, struct Thd **next_store)
+{
+	int r;
+
+	if ((r = ipc_send(t, e, to, value, srcva, perm, 0, next_store)) < 0)
+		return r;
+	return ipc_wait(t, dstva, next_store);
+}
+
+// Reply to e, if e is not NULL, and then receive as ipc_recv does.  A
+// reply that fails is dropped: a server has nobody to report it to, and
+// the failure is counted in e's ipc statistics if its mailbox was full.
+// Returns and stores *next_store as ipc_call does.
+int
+ipc_reply_wait(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+	       void *srcva, unsigned perm, void *dstva, struct Thd **next_store)
+{
+	*next_store = NULL;
+	if (e)
+		ipc_send(t, e, to, value, srcva, perm, 0, next_store);
+	return ipc_wait(t, dstva, next_store);
+}
+
+// Take t out of any IPC it is blocked in, without waking it: off the
+// mailbox it is sending to, its message unsent, and off its env's
+// receivers.  Its system call then fails with -E_AGAIN.  For a thread
+// that is made runnable by other means, so that no send or receive
+// finds it later while it runs.
+void
+ipc_abort(struct Thd *t)
+{
+	struct Env *e = t->thd_ipc_to;
+
+	if (e) {
+		spin_lock(&e->env_ipc_lock);
+		if (t->thd_ipc_to == e) {
+			ipc_unlink(&e->env_ipc_mbox->send_head,
+				   &e->env_ipc_mbox->send_tail, t);
+			t->thd_ipc_to = NULL;
+			if (t->thd_ipc_out_pp)
+				page_decref(t->thd_ipc_out_pp);
+			t->thd_ipc_out_pp = NULL;
+			t->thd_tf.tf_regs.reg_eax = -E_AGAIN;
+		}
+		spin_unlock(&e->env_ipc_lock);
+	}
+
+	e = t->thd_env;
+	spin_lock(&e->env_ipc_lock);
+	if (t->thd_ipc_recving) {
+		ipc_unlink(&e->env_ipc_recv_head, &e->env_ipc_recv_tail, t);
+		t->thd_ipc_recving = 0;
+		t->thd_tf.tf_regs.reg_eax = -E_AGAIN;
+	}
+	spin_unlock(&e->env_ipc_lock);
+}
+
+// Take t, which is being freed, out of IPC as ipc_abort does.  What
+// was sent to t alone can no longer be received; it is dropped, and its
+// blocked senders fail with -E_BAD_ENV.
+void
+ipc_cancel(struct Thd *t)
+{
+	struct Env *e = t->thd_env;
+	struct IpcMbox *mb;
+	struct IpcMsg m;
+	struct Thd *s, *next;
+	int i;
+
+	ipc_abort(t);
+	spin_lock(&e->env_ipc_lock);
+	if ((mb = e->env_ipc_mbox) != NULL) {
+		for (s = mb->send_head; s; s = next) {
+			next = s->thd_ipc_next;
+			if (s->thd_ipc_out_thd != t->thd_id)
+				continue;
+			s->thd_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			ipc_take_sender(mb, s, &m);
+			if (m.pp)
+				page_decref(m.pp);
+		}
+		for (i = 0; i < mb->count; )
+			if (mb->msgs[(mb->head + i) % IPC_QLEN].to == t->thd_id) {
+				ipc_take(mb, i, &m);
+				if (m.pp)
+					page_decref(m.pp);
+			} else
+				i++;
+		ipc_refill(e, mb);
+	}
+	spin_unlock(&e->env_ipc_lock);
+}
+
+// Free e's mailbox once e's address space is gone.  Senders still
+// blocked on it fail with -E_BAD_ENV.
+void
+ipc_env_free(struct Env *e)
+{
+	struct IpcMbox *mb;
+	struct IpcMsg m;
+
+	spin_lock(&e->env_ipc_lock);
+	if ((mb = e->env_ipc_mbox) != NULL) {
+		while (mb->send_head) {
+			mb->send_head->thd_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			ipc_take_sender(mb, mb->send_head, &m);
+			if (m.pp)
+				page_decref(m.pp);
+		}
+		while (mb->count > 0) {
+			ipc_take(mb, 0, &m);
+			if (m.pp)
+				page_decref(m.pp);
+		}
+		kfree(mb);
+		e->env_ipc_mbox = NULL;
+	}
+	e->env_ipc_queued = 0;
+	spin_unlock(&e->env_ipc_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int ipc_send(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+	     void *srcva, unsigned perm, bool block, struct Thd **wake_store);
+int ipc_recv(struct Thd *t, void *dstva);
+int ipc_call(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+	     void *srcva, unsigned perm, void *dstva, struct Thd **next_store);
+int ipc_reply_wait(struct Thd *t, struct Env *e, thdid_t to, uint32_t value,
+		   void *srcva, unsigned perm, void *dstva,
+		   struct Thd **next_store);
+void ipc_abort(struct Thd *t);
+void ipc_cancel(struct Thd *t);
+void ipc_env_free(struct Env *e);
+
+#endif	// !JOS_KERN_IPC_H
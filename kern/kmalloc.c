@@ -0,0 +1,224 @@
+// Kernel memory allocator for objects smaller than a page.
+//
+// Requests are rounded up to a power-of-two size class.  Each class is
+// a cache of slabs: pages cut into objects of that size, with a pointer
+// back to the cache at the start of the page so that kfree can find it.
+// A cache keeps its free objects on a list, and in front of that list
+// every CPU has a small array of objects of its own, so that most
+// kmalloc and kfree calls take no lock.  Objects move between a CPU's
+// array and the list KMEM_BATCH at a time.  Slabs are never given back
+// to the page allocator.
+//
+// Requests larger than the largest class get whole pages straight from
+// page_alloc_order; they are told apart in kfree by being page-aligned,
+// which slab objects never are.
+//
+// A cache's lock is taken before page_lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MIN_SHIFT	4	// 16 bytes
+#define KMEM_MAX_SHIFT	10	// 1KB
+#define KMEM_NCACHE	(KMEM_MAX_SHIFT - KMEM_MIN_SHIFT + 1)
+#define KMEM_MAG_SIZE	32
+#define KMEM_BATCH	16
+#define KMEM_SLAB_HDR	16	// struct KmemSlab, padded for alignment
+
+struct KmemCpu {
+	int n;
+	void *obj[KMEM_MAG_SIZE];	// Most recently freed last
+	uint32_t allocs;
+	uint32_t frees;
+};
+
+static struct KmemCache {
+	const char *name;
+	size_t size;
+	struct spinlock lock;		// Protects free, nfree and nslabs
+	void *free;			// Linked through each object's first word
+	uint32_t nfree;
+	uint32_t nslabs;
+	struct KmemCpu cpu[NCPU];
+} kmem_caches[KMEM_NCACHE];
+
+static const char *const kmem_names[KMEM_NCACHE] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+struct KmemSlab {
+	struct KmemCache *cache;
+};
+
+// Counts for the whole-page allocations
+static struct KmemCpu kmem_pages[NCPU];
+
+void
+kmem_init(void)
+{
+	int i;
+
+	static_assert(sizeof(struct KmemSlab) <= KMEM_SLAB_HDR);
+	for (i = 0; i < KMEM_NCACHE; i++) {
+		kmem_caches[i].name = kmem_names[i];
+		kmem_caches[i].size = 1 << (i + KMEM_MIN_SHIFT);
+		__spin_initlock(&kmem_caches[i].lock, "kmem_lock");
+	}
+}
+
+// Cut a new page into objects for cache c.  c must be locked.
+static int
+kmem_grow(struct KmemCache *c)
+{
+	struct PageInfo *pp;
+	struct KmemSlab *slab;
+	char *obj;
+
+	if ((pp = page_alloc(0)) == NULL)
+		return -E_NO_MEM;
+	slab = page2kva(pp);
+	slab->cache = c;
+	for (obj = (char *) slab + KMEM_SLAB_HDR;
+	     obj + c->size <= (char *) slab + PGSIZE; obj += c->size) {
+		*(void **) obj = c->free;
+		c->free = obj;
+		c->nfree++;
+	}
+	c->nslabs++;
+	return 0;
+}
+
+static void *
+kmem_alloc_pages(size_t size, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int order = 0;
+
+	while ((PGSIZE << order) < size)
+		if (++order > PAGE_MAX_ORDER)
+			return NULL;
+	if ((pp = page_alloc_order(alloc_flags, order)) == NULL)
+		return NULL;
+	kmem_pages[cpunum()].allocs++;
+	return page2kva(pp);
+}
+
+//
+// Allocate size bytes of kernel memory, zeroed if (alloc_flags &
+// ALLOC_ZERO).  Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmemCache *c;
+	struct KmemCpu *kc;
+	void *obj;
+	int i;
+
+	for (i = 0; i < KMEM_NCACHE && size > kmem_caches[i].size; i++)
+		;
+	if (i == KMEM_NCACHE)
+		return kmem_alloc_pages(size, alloc_flags);
+
+	c = &kmem_caches[i];
+	kc = &c->cpu[cpunum()];
+	if (kc->n == 0) {
+		spin_lock(&c->lock);
+		while (kc->n < KMEM_BATCH && (c->free || kmem_grow(c) == 0)) {
+			obj = c->free;
+			c->free = *(void **) obj;
+			c->nfree--;
+			kc->obj[kc->n++] = obj;
+		}
+		spin_unlock(&c->lock);
+		if (kc->n == 0)
+			return NULL;
+	}
+	obj = kc->obj[--kc->n];
+	kc->allocs++;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, size);
+	return obj;
+}
+
+//
+// Free memory from kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct PageInfo *pp;
+	struct KmemCache *c;
+	struct KmemCpu *kc;
+	int i;
+
+	if (p == NULL)
+		return;
+	if (PGOFF(p) == 0) {
+		pp = pa2page(PADDR(p));
+		page_free_order(pp, pp->pp_order);
+		kmem_pages[cpunum()].frees++;
+		return;
+	}
+
+	c = ((struct KmemSlab *) ROUNDDOWN(p, PGSIZE))->cache;
+	assert(c >= kmem_caches && c < kmem_caches + KMEM_NCACHE);
+	kc = &c->cpu[cpunum()];
+	if (kc->n == KMEM_MAG_SIZE) {
+		// Give the least recently freed objects back
+		spin_lock(&c->lock);
+		for (i = 0; i < KMEM_BATCH; i++) {
+			*(void **) kc->obj[i] = c->free;
+			c->free = kc->obj[i];
+			c->nfree++;
+		}
+		spin_unlock(&c->lock);
+		memmove(kc->obj, kc->obj + KMEM_BATCH,
+			(kc->n - KMEM_BATCH) * sizeof(kc->obj[0]));
+		kc->n -= KMEM_BATCH;
+	}
+	kc->obj[kc->n++] = p;
+	kc->frees++;
+}
+
+// Sum the per-CPU counts in kc[0..ncpu).
+static void
+kmem_sum(struct KmemCpu *kc, uint32_t *allocs, uint32_t *frees, int *cached)
+{
+	int i;
+
+	*allocs = *frees = *cached = 0;
+	for (i = 0; i < ncpu; i++) {
+		*allocs += kc[i].allocs;
+		*frees += kc[i].frees;
+		*cached += kc[i].n;
+	}
+}
+
+// Print usage of each cache, for the monitor.  Other CPUs update their
+// counts as we read them, so this is only a snapshot.
+void
+kmem_print(void)
+{
+	struct KmemCache *c;
+	uint32_t allocs, frees;
+	int cached;
+
+	cprintf("CACHE          SLABS  INUSE   FREE    ALLOCS     FREES\n");
+	for (c = kmem_caches; c < kmem_caches + KMEM_NCACHE; c++) {
+		kmem_sum(c->cpu, &allocs, &frees, &cached);
+		cprintf("%-13s  %5u  %5u  %5u  %8u  %8u\n", c->name,
+			c->nslabs, allocs - frees, c->nfree + cached,
+			allocs, frees);
+	}
+	kmem_sum(kmem_pages, &allocs, &frees, &cached);
+	cprintf("%-13s  %5s  %5u  %5s  %8u  %8u\n", "pages", "-",
+		allocs - frees, "-", allocs, frees);
+}
@@ -33,6 +33,7 @@
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
 	#define PERIODIC   0x00020000   // Periodic
+	#define ONESHOT    0x00000000   // One-shot
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
@@ -45,6 +46,10 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts per millisecond; the same bus clock drives every CPU's
+// timer, so one calibration on the BSP serves them all.
+static uint32_t lapic_ticks_per_ms;
+
 static void
 lapicw(int index, int value)
 {
@@ -65,13 +70,13 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It stays idle until the
+	// scheduler arms it with lapic_timer_set(), so a CPU with nothing
+	// to do takes no timer interrupts at all.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -180,3 +185,50 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt to the CPU cpus[cpu].
+void
+lapic_ipi_cpu(int cpu, int vector)
+{
+	lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Measure the timer's rate against the TSC, which counts tsc_per_ms
+// cycles per millisecond.
+void
+lapic_timer_calibrate(uint32_t tsc_per_ms)
+{
+	uint64_t t0;
+
+	if (!lapic)
+		return;
+	// Let it count down from the top, without interrupting us
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+	t0 = read_tsc();
+	while (read_tsc() - t0 < (uint64_t) tsc_per_ms * 10)
+		;
+	lapic_ticks_per_ms = (0xffffffff - lapic[TCCR]) / 10;
+	lapicw(TICR, 0);
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+}
+
+// Interrupt this CPU once, usec microseconds from now.  Replaces any
+// earlier setting; 0 stops the timer.
+void
+lapic_timer_set(uint32_t usec)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	count = (uint64_t) lapic_ticks_per_ms * usec / 1000;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	if (usec && count == 0)
+		count = 1;
+	lapicw(TICR, count);
+}
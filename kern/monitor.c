@@ -11,6 +11,12 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,6 +32,11 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display function stack one line at a time", mon_backtrace},
+	{ "top", "Display CPU usage per CPU, environment and thread", mon_top },
+	{ "locks", "Display spinlock contention ('locks reset' clears it)", mon_locks },
+	{ "pages", "Display free physical memory blocks by order", mon_pages },
+	{ "kmem", "Display kernel object cache usage", mon_kmem },
+	{ "ipc", "Display IPC mailbox depth and queued, blocked and dropped sends", mon_ipc },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -77,6 +88,102 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_dump(argc > 1 && strcmp(argv[1], "reset") == 0);
+	return 0;
+}
+
+int
+mon_pages(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_free();
+	return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print();
+	return 0;
+}
+
+// Show each env's IPC mailbox: messages waiting now, and since the env
+// was created, the sends that were queued, that blocked on a full
+// mailbox and that were refused for one.
+int
+mon_ipc(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+
+	cprintf("ENV       QUEUED   NQUEUED  NBLOCKED  NDROPPED\n");
+	for (e = envs; e < envs + envtabs->et_nenv; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x  %6u  %8u  %8u  %8u\n", e->env_id,
+			e->env_ipc_queued, e->env_ipc_nqueued,
+			e->env_ipc_nblocked, e->env_ipc_ndropped);
+	}
+	return 0;
+}
+
+// Show where the CPU time went since boot.  Times are in milliseconds;
+// WAIT is time spent runnable but waiting for a CPU.
+int
+mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char *thd_status[] = {
+		"free", "dying", "ready", "run", "block"
+	};
+	uint32_t tsc_per_ms = time_tsc_per_ms();
+	uint64_t total, runtime, wait_time;
+	uint32_t runs, migrations;
+	struct CpuStat *cs;
+	struct Env *e;
+	struct Thd *t;
+	int i;
+
+	cprintf("CPU  BUSY  SWITCHES  STEALS  HANDOFFS\n");
+	for (i = 0; i < ncpu; i++) {
+		cs = &cpustats[i];
+		total = cs->cs_busy + cs->cs_idle;
+		cprintf("%3d  %3u%%  %8u  %6u  %8u\n", i,
+			total ? (uint32_t) (cs->cs_busy * 100 / total) : 0,
+			cs->cs_switches, cs->cs_steals,
+			cs->cs_handoffs);
+	}
+
+	cprintf("\nENV/THD   STATE  PRI CPU     RUN    WAIT  SWITCHES  MIGR\n");
+	for (e = envs; e < envs + envtabs->et_nenv; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		runtime = e->env_runtime;
+		wait_time = e->env_wait_time;
+		runs = e->env_runs;
+		migrations = e->env_migrations;
+		for (t = e->env_thd_head; t; t = t->thd_next) {
+			runtime += t->thd_runtime;
+			wait_time += t->thd_wait_time;
+			runs += t->thd_runs;
+			migrations += t->thd_migrations;
+		}
+		cprintf("%08x  %-5s           %7u %7u  %8u  %4u\n",
+			e->env_id, e->env_type == ENV_TYPE_FS ? "fs" :
+			e->env_type == ENV_TYPE_NS ? "ns" : "user",
+			(uint32_t) (runtime / tsc_per_ms),
+			(uint32_t) (wait_time / tsc_per_ms), runs, migrations);
+		for (t = e->env_thd_head; t; t = t->thd_next)
+			cprintf("  %08x %-5s %3d %3d %7u %7u  %8u  %4u\n",
+				t->thd_id, thd_status[t->thd_status],
+				t->thd_priority, t->thd_cpunum,
+				(uint32_t) (t->thd_runtime / tsc_per_ms),
+				(uint32_t) (t->thd_wait_time / tsc_per_ms),
+				t->thd_runs, t->thd_migrations);
+	}
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
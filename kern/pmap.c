@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,8 +19,59 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
-
+// Free physical memory is kept in blocks of 1 << order pages, aligned to
+// their size, with one list per order (a buddy allocator).
+static struct PageInfo *page_free_area[PAGE_MAX_ORDER + 1];
+static size_t page_free_blocks[PAGE_MAX_ORDER + 1];
+// Per-CPU caches ("magazines") of free pages in front of the buddy lists,
+// so that most single-page allocations and frees touch neither page_lock
+// nor the list heads.  Only the owning CPU uses its magazine, and the
+// kernel runs with interrupts off, so magazines need no lock.  Pages
+// move between a magazine and the buddy lists PAGE_MAG_BATCH at a time.
+#define PAGE_MAG_SIZE	64
+#define PAGE_MAG_BATCH	32
+static struct PageMag {
+	int n;
+	struct PageInfo *pp[PAGE_MAG_SIZE];	// Most recently freed last
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t refills;			// Batches taken from the lists
+	uint32_t drains;			// Batches given back
+	uint32_t zero_hits;			// ALLOC_ZERO served pre-zeroed
+	uint32_t zero_misses;
+} page_mags[NCPU];
+// Free pages that idle CPUs zeroed ahead of time (see page_zero_idle),
+// so that ALLOC_ZERO allocations need not zero a page while the caller
+// waits.  Linked by pp_link.
+#define PAGE_ZERO_MAX	256
+#define PAGE_ZERO_BATCH	8	// Pages zeroed per trip through sched_halt
+static struct PageInfo *page_zero_list;
+static volatile int page_zero_count;
+static struct spinlock page_zero_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_zero_lock"
+#endif
+};
+// Pages at or above this index are not handed out.  Until kern_pgdir is
+// loaded that is everything above the 4MB that entry_pgdir maps.
+static size_t page_alloc_limit;
+// Protects the free lists and the pp_ref of pages that may be shared
+// between address spaces.  Page tables themselves are protected by the
+// env_vm_lock of the env that owns them.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+// What untouched demand-zero memory reads as (see page_user_fault).
+// Mapped copy-on-write and never freed.  Its mappings aren't counted:
+// there can be more of them than pp_ref holds.  The reference taken at
+// boot pins it.
+static struct PageInfo *zero_page;
+
+// Everything mapped read-only at UENVS: envs, thds, cpustats and envtabs
+#define UENVS_SIZE	(sizeof(struct Env) * NENV + sizeof(struct Thd) * NTHD + \
+			 sizeof(struct CpuStat) * NCPU + sizeof(struct EnvTabs))
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -71,6 +123,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void tlb_remove(pde_t *pgdir, void *va, struct PageInfo *pp);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -83,7 +136,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free lists have been set up.
 // Note that when this function is called, we are still using entry_pgdir,
 // which only maps the first 4MB of physical memory.
 static void *
@@ -167,10 +220,14 @@ mem_init(void)
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
 	// LAB 3: Your code here.
 	// 为ENVS数组分配空间，还有Thd
-	envs = (struct Env*) boot_alloc(sizeof(struct Env) * NENV + sizeof(struct Thd) * NTHD);
+	// The tables live at KENVS and only get pages as they grow (see
+	// pmap_map_envs).  The scheduler's per-CPU accounting and the
+	// table sizes follow, in the same mapping.
+	envs = (struct Env*) KENVS;
 	thds = (struct Thd*)&envs[NENV];
-	memset(envs, 0, sizeof(struct Env) * NENV + sizeof(struct Thd) * NTHD);
-	
+	cpustats = (struct CpuStat*)&thds[NTHD];
+	envtabs = (struct EnvTabs*)&cpustats[NCPU];
+
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -207,9 +264,13 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 	// 这里也要改
-	boot_map_region(kern_pgdir, UENVS, 
-		ROUNDUP(sizeof(struct Env) * NENV + sizeof(struct Thd) * NTHD, PGSIZE),
-		PADDR(envs), PTE_U);
+	// Set up the page tables now, so that every env_pgdir shares them
+	// and sees the tables grow; then map cpustats and envtabs.
+	static_assert(UENVS_SIZE <= PTSIZE);
+	if (!pgdir_walk(kern_pgdir, (void *) KENVS, 1) ||
+	    !pgdir_walk(kern_pgdir, (void *) UENVS, 1) ||
+	    pmap_map_envs((char *) cpustats - (char *) envs, UENVS_SIZE) < 0)
+		panic("mem_init: out of memory for the env tables");
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -233,7 +294,11 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KERNBASE, 0xffffffff - KERNBASE, 0, PTE_W);
+	// Use 4MB pages: 64 PDEs and no page tables, and far fewer TLB
+	// entries for the kernel's own accesses.
+	lcr4(rcr4() | CR4_PSE);
+	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xffffffff - KERNBASE, PTSIZE),
+			0, PTE_W | PTE_G | PTE_PS);
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -249,6 +314,7 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
+	page_alloc_limit = npages;
 
 	check_page_free_list(0);
 
@@ -258,9 +324,16 @@ mem_init(void)
 	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
+	// Kernel mappings are the same in every address space; keep them
+	// in the TLB across lcr3.
+	lcr4(rcr4() | CR4_PGE);
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	if ((zero_page = page_alloc(ALLOC_ZERO)) == NULL)
+		panic("mem_init: out of memory for the zero page");
+	zero_page->pp_ref++;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -291,7 +364,7 @@ mem_init_mp(void)
 			KSTACKTOP - KSTKSIZE - i * (KSTKSIZE + KSTKGAP), 
 			KSTKSIZE, 
 			PADDR(percpu_kstacks[i]), 
-			PTE_W
+			PTE_W | PTE_G
 		);
 	}
 }
@@ -299,14 +372,206 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept in buddy blocks.
 // --------------------------------------------------------------
 
+// Put the free block of 1 << order pages at pp on its free list.
+// page_lock must be held.
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+	page_free_blocks[order]++;
+}
+
+// Take the free block at pp off its free list.  page_lock must be held.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	int order = pp->pp_order;
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+	page_free_blocks[order]--;
+}
+
+// Free the block of 1 << order pages at pp, merging it with its buddy
+// for as long as the buddy is a free block of the same size.
+// page_lock must be held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, b;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		b = i ^ (1 << order);
+		if (b + (1 << order) > npages || !pages[b].pp_free ||
+		    pages[b].pp_order != order)
+			break;
+		buddy_remove(&pages[b]);
+		i &= ~(1 << order);
+	}
+	buddy_push(&pages[i], order);
+}
+
+// Take a free block of 1 << order pages, splitting a larger block if
+// there is none.  Returns NULL if there is no block big enough.
+// page_lock must be held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp = NULL;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !pp; o++)
+		for (pp = page_free_area[o]; pp; pp = pp->pp_link)
+			if (pp - pages + (1 << o) <= page_alloc_limit)
+				break;
+	if (!pp)
+		return NULL;
+	o--;
+	buddy_remove(pp);
+	// Keep the lower half and free the upper half until the block has
+	// the size asked for.
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
+	}
+	pp->pp_order = order;
+	return pp;
+}
+
+// Give the n least recently freed pages in magazine m back to the buddy
+// lists.
+static void
+page_mag_drain(struct PageMag *m, int n)
+{
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++)
+		buddy_free(m->pp[i], 0);
+	spin_unlock(&page_lock);
+	memmove(m->pp, m->pp + n, (m->n - n) * sizeof(m->pp[0]));
+	m->n -= n;
+	m->drains++;
+}
+
+// Take a page from this CPU's magazine, refilling it if it is empty.
+static struct PageInfo *
+page_mag_alloc(void)
+{
+	struct PageMag *m = &page_mags[cpunum()];
+	struct PageInfo *pp;
+
+	if (m->n == 0) {
+		spin_lock(&page_lock);
+		while (m->n < PAGE_MAG_BATCH && (pp = buddy_alloc(0)) != NULL)
+			m->pp[m->n++] = pp;
+		spin_unlock(&page_lock);
+		if (m->n == 0)
+			return NULL;
+		m->refills++;
+	}
+	m->allocs++;
+	return m->pp[--m->n];
+}
+
+// Take a page from the pool of zeroed pages, or return NULL if it is empty.
+static struct PageInfo *
+page_zero_take(void)
+{
+	struct PageInfo *pp;
+
+	if (page_zero_count == 0)
+		return NULL;
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_zero_count--;
+	}
+	spin_unlock(&page_zero_lock);
+	if (pp)
+		pp->pp_link = NULL;
+	return pp;
+}
+
+// Give all the pages in the pool of zeroed pages back to the buddy lists.
+static void
+page_zero_drain(void)
+{
+	struct PageInfo *pp, *next;
+
+	if (page_zero_count == 0)
+		return;
+	spin_lock(&page_zero_lock);
+	pp = page_zero_list;
+	page_zero_list = NULL;
+	page_zero_count = 0;
+	spin_unlock(&page_zero_lock);
+
+	spin_lock(&page_lock);
+	for (; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+// Called by an idle CPU on its way to halt: zero a few free pages for
+// the pool.  Interrupts are off, so stop as soon as this CPU has been
+// given something to run.
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < PAGE_ZERO_BATCH; i++) {
+		if (page_zero_count >= PAGE_ZERO_MAX ||
+		    *(volatile int *) &thiscpu->cpu_rq_len > 0)
+			break;
+		if ((pp = page_mag_alloc()) == NULL)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		spin_unlock(&page_zero_lock);
+	}
+}
+
+// Put a page in this CPU's magazine, making room first if it is full.
+static void
+page_mag_free(struct PageInfo *pp)
+{
+	struct PageMag *m = &page_mags[cpunum()];
+
+	if (m->n == PAGE_MAG_SIZE)
+		page_mag_drain(m, PAGE_MAG_BATCH);
+	m->pp[m->n++] = pp;
+	m->frees++;
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the free lists.
 //
 void
 page_init(void)
@@ -332,7 +597,7 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	// 初始化pages数组，建立page_free_list链表
+	// 初始化pages数组，建立空闲块链表
 	// 已使用的物理页包括如下几部分：
 	// 1）第一个物理页是IDT所在
 	// 2）[IOPHYSMEM, EXTPHYSMEM)称为IO hole的区域
@@ -342,24 +607,24 @@ page_init(void)
 	size_t kernel_end_page = PADDR(boot_alloc(0)) / PGSIZE;	//boot_alloc返回的是虚拟地址，需要转为物理地址
 
 	for (i = 0; i < npages; i++) {
-		if (i == 0) {
+		pages[i].pp_link = NULL;
+		if (i == 0)
 			pages[0].pp_ref = 1;
-			pages[0].pp_link = NULL;
-		}
-		else if (i >= io_hole_start_page && i < kernel_end_page) {
+		else if (i >= io_hole_start_page && i < kernel_end_page)
 			pages[i].pp_ref = 1;
-			pages[i].pp_link = NULL;
-		}
-		else {
+		// 把MPENTRY_PADDR这块地址也留出来，不放进空闲列表
+		else if (i == PGNUM(MPENTRY_PADDR))
+			pages[i].pp_ref = 1;
+		else
 			pages[i].pp_ref = 0;
-			pages[i].pp_link = page_free_list;
-			page_free_list = &pages[i];
-		}
 	}
-	// 把MPENTRY_PADDR这块地址也在空闲列表里面删除。
-	uint32_t range_mpentry = PGNUM(MPENTRY_PADDR);
-	pages[range_mpentry+1].pp_link=pages[range_mpentry].pp_link;
-	pages[range_mpentry].pp_link=NULL;
+
+	// Free from the top down, so that after merging the lowest blocks
+	// come first on each list.
+	page_alloc_limit = MIN(npages, PGNUM(PTSIZE));
+	for (i = npages; i-- > 0; )
+		if (pages[i].pp_ref == 0)
+			buddy_free(&pages[i], 0);
 }
 
 //
@@ -374,21 +639,65 @@ page_init(void)
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
-// 从page_free_list中取空闲空间，根据flags决定要不要初始化0
+// 从空闲链表中取一页，根据flags决定要不要初始化0
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	struct PageInfo* ret = page_free_list;
+	struct PageInfo* ret;
+
+	ret = page_alloc_order(alloc_flags, 0);
 	if(ret == NULL){
 		cprintf("page_alloc: out of memory\n");
 		return NULL;
 	}
-	page_free_list = ret->pp_link;
-	ret->pp_link = NULL;
-	if(alloc_flags & ALLOC_ZERO){
-		memset(page2kva(ret), 0, PGSIZE);
+	return ret;
+}
+
+//
+// Allocates 1 << order physically contiguous pages, aligned to their
+// size, and returns the first.  Only the first page's pp_ref counts;
+// free the block with page_free_order and the same order.
+//
+// Returns NULL if there is no free block that large.
+//
+struct PageInfo *
+page_alloc_order(int alloc_flags, int order)
+{
+	struct PageInfo *ret;
+	struct PageMag *m = &page_mags[cpunum()];
+
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	if (order == 0 && (alloc_flags & ALLOC_ZERO)) {
+		if ((ret = page_zero_take()) != NULL) {
+			m->zero_hits++;
+			return ret;
+		}
+		m->zero_misses++;
 	}
+	if (order == 0) {
+		// When memory runs short the zeroed pages are all that is left.
+		if ((ret = page_mag_alloc()) == NULL &&
+		    (ret = page_zero_take()) != NULL)
+			return ret;
+	} else {
+		spin_lock(&page_lock);
+		ret = buddy_alloc(order);
+		spin_unlock(&page_lock);
+		// Pages sitting in our magazine or in the zeroed pool may be
+		// all that keeps a block from merging; give them back and
+		// try again.
+		if (!ret && (m->n > 0 || page_zero_count > 0)) {
+			if (m->n > 0)
+				page_mag_drain(m, m->n);
+			page_zero_drain();
+			spin_lock(&page_lock);
+			ret = buddy_alloc(order);
+			spin_unlock(&page_lock);
+		}
+	}
+	if (ret && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(ret), 0, PGSIZE << order);
 	return ret;
 }
 
@@ -402,22 +711,95 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
-	if(pp->pp_ref != 0 || pp->pp_link != NULL){
+	page_free_order(pp, 0);
+}
+
+//
+// Return a block from page_alloc_order to the free lists, merging it
+// with its buddies where they are free too.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if(pp->pp_ref != 0 || pp->pp_link != NULL || pp->pp_free){
 		panic("page_free: pp->pp_ref is nonzero or pp->pp_link is not NULL.\n");
 	}
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((pp - pages) % (1 << order) == 0);
+	if (order == 0) {
+		page_mag_free(pp);
+		return;
+	}
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+// Print the number of free blocks of each size and the state of the
+// per-CPU magazines, for the monitor.
+void
+page_print_free(void)
+{
+	size_t blocks[PAGE_MAX_ORDER + 1], nfree = 0;
+	struct PageMag *m;
+	int o;
+
+	spin_lock(&page_lock);
+	memcpy(blocks, page_free_blocks, sizeof(blocks));
+	spin_unlock(&page_lock);
+
+	cprintf("ORDER  BLOCK  FREE\n");
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		cprintf("%5d  %4dK  %4u\n", o, (PGSIZE << o) / 1024, blocks[o]);
+		nfree += blocks[o] << o;
+	}
+
+	// Other CPUs update their magazines as we read them, so this is
+	// only a snapshot.
+	cprintf("\nCPU  CACHED  ALLOCS  FREES  REFILLS  DRAINS  ZHITS  ZMISSES\n");
+	for (m = page_mags; m < page_mags + ncpu; m++) {
+		cprintf("%3d  %6d  %6u  %5u  %7u  %6u  %5u  %7u\n",
+			m - page_mags, m->n, m->allocs, m->frees, m->refills,
+			m->drains, m->zero_hits, m->zero_misses);
+		nfree += m->n;
+	}
+	cprintf("%d pre-zeroed pages\n", page_zero_count);
+	nfree += page_zero_count;
+	cprintf("%u pages (%uK) free\n", nfree, nfree * (PGSIZE / 1024));
 }
 
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// For the first page of a block from page_alloc_order, the whole block
+// goes.  zero_page's references aren't counted, here or in page_incref.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
-		page_free(pp);
+	uint16_t ref;
+
+	if (pp == zero_page)
+		return;
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+	if (ref == 0)
+		page_free_order(pp, pp->pp_order);
+}
+
+//
+// Increment the reference count on a page that may be mapped
+// by other address spaces too.
+//
+void
+page_incref(struct PageInfo* pp)
+{
+	if (pp == zero_page)
+		return;
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -441,6 +823,9 @@ page_decref(struct PageInfo* pp)
 //
 // Hint 3: look at inc/mmu.h for useful macros that manipulate page
 // table and page directory entries.
+//
+// If va lies in a 4MB page (a PDE with PTE_PS), there is no page table:
+// the PDE itself maps va, and pgdir_walk returns a pointer to it.
 // 获取va所在的PTE（页表）地址
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
@@ -461,6 +846,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 			return NULL;
 		}
 	}
+	if (*pde_ptr & PTE_PS)
+		return pde_ptr;
 	// KADDR：物理地址转换为线性地址
 	return (pte_t *)KADDR(PTE_ADDR(*pde_ptr)) + PTX(va);
 }
@@ -475,11 +862,20 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// With PTE_PS in perm, map with 4MB pages instead; then va, pa and size
+// must be multiples of PTSIZE.
+//
 // Hint: the TA solution uses pgdir_walk
 // 通过修改pgdir指向的树，将[va, va+size)对应的虚拟地址空间映射到物理地址空间[pa, pa+size)。
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
+	if (perm & PTE_PS) {
+		assert(va % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+		for (; size > 0; size -= PTSIZE, va += PTSIZE, pa += PTSIZE)
+			pgdir[PDX(va)] = pa | perm | PTE_P;
+		return;
+	}
 	// 计算有多少页，并向上取整
 	size_t pages_num = size / PGSIZE;
 	if (size % PGSIZE != 0) pages_num++;
@@ -496,6 +892,160 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+// page_insert for a 4MB page.
+static int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	int i;
+
+	assert((uintptr_t) va % PTSIZE == 0);
+	assert(pp->pp_order == PAGE_LARGE_ORDER);
+	page_incref(pp);
+	if (*pde & PTE_PS)
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P) {
+		// Empty the page table and free it, once no CPU can be
+		// walking it any more.
+		pt = (pte_t *) KADDR(PTE_ADDR(*pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P)
+				page_remove(pgdir, PGADDR(PDX(va), i, 0));
+		*pde = 0;
+		tlb_remove(pgdir, va, pa2page(PADDR(pt)));
+	}
+	*pde = page2pa(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// Back bytes [start, end) of the env tables with zeroed pages, mapped
+// read-write at KENVS and read-only at UENVS.  Pages already there stay.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+pmap_map_envs(size_t start, size_t end)
+{
+	struct PageInfo *pp;
+	pte_t *kpte, *upte;
+	size_t off;
+
+	assert(end <= PTSIZE);
+	for (off = ROUNDDOWN(start, PGSIZE); off < end; off += PGSIZE) {
+		kpte = pgdir_walk(kern_pgdir, (void *) (KENVS + off), 0);
+		upte = pgdir_walk(kern_pgdir, (void *) (UENVS + off), 0);
+		if (*kpte & PTE_P)
+			continue;
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+		pp->pp_ref++;
+		*upte = page2pa(pp) | PTE_U | PTE_P;
+		*kpte = page2pa(pp) | PTE_W | PTE_P;
+	}
+	return 0;
+}
+
+//
+// Fill dst, a fresh page directory, with a copy-on-write copy of the
+// user part of src, in one pass over src's present PDEs and PTEs:
+//   - PTE_SHARE pages are mapped in dst as they are in src;
+//   - other writable or copy-on-write pages become PTE_COW and
+//     read-only in both;
+//   - the remaining pages are mapped read-only in both;
+//   - 4MB pages are shared if PTE_SHARE and copied right away otherwise;
+//   - demand-zero reservations are reserved in dst too, except that
+//     PTE_SHARE ones get their page in src first and share it;
+//   - the page at UXSTACKTOP - PGSIZE is left out.
+// src's address space must be locked.
+// Returns 0 on success, -E_NO_MEM if out of memory, in which case dst
+// holds part of the copy and must be freed.
+//
+int
+pmap_fork(pde_t *src, pde_t *dst)
+{
+	struct PageInfo *pp;
+	pte_t *spt, *dpt, pte;
+	uint32_t pdx, ptx, perm;
+	uintptr_t va;
+
+	tlb_batch_begin();
+	for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+		if (!(src[pdx] & PTE_P))
+			continue;
+
+		if (src[pdx] & PTE_PS) {
+			pp = pa2page(PTE_ADDR(src[pdx]));
+			if (!(src[pdx] & PTE_SHARE)) {
+				if ((pp = page_alloc_order(0, PAGE_LARGE_ORDER)) == NULL)
+					goto nomem;
+				memcpy(page2kva(pp), KADDR(PTE_ADDR(src[pdx])), PTSIZE);
+			}
+			page_incref(pp);
+			dst[pdx] = page2pa(pp) | (src[pdx] & (PTE_SYSCALL | PTE_PS));
+			continue;
+		}
+
+		// Shared memory must be the same page in both, so an untouched
+		// shared reservation gets its page now.  Do it before copying
+		// any of the page table: running out of memory half way
+		// through the copy would leave PTEs in dst whose references
+		// haven't been taken yet.
+		spt = (pte_t *) KADDR(PTE_ADDR(src[pdx]));
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			pte = spt[ptx];
+			if ((pte & (PTE_P | PTE_ANON | PTE_SHARE)) !=
+			    (PTE_ANON | PTE_SHARE))
+				continue;
+			if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+				goto nomem;
+			page_incref(pp);
+			spt[ptx] = page2pa(pp) | (pte & PTE_SYSCALL) | PTE_P;
+		}
+
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			goto nomem;
+		pp->pp_ref++;
+		dst[pdx] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+		dpt = (pte_t *) page2kva(pp);
+
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			pte = spt[ptx];
+			va = (uintptr_t) PGADDR(pdx, ptx, 0);
+			if (va == UXSTACKTOP - PGSIZE)
+				continue;
+			if (!(pte & PTE_P)) {
+				if (pte & PTE_ANON)
+					dpt[ptx] = pte & (PTE_ANON | PTE_SYSCALL);
+				continue;
+			}
+			perm = pte & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pte & PTE_W) {
+					spt[ptx] = PTE_ADDR(pte) | perm;
+					tlb_invalidate(src, (void *) va);
+				}
+			}
+			dpt[ptx] = PTE_ADDR(pte) | perm;
+		}
+
+		// One trip to page_lock for the whole page table
+		spin_lock(&page_lock);
+		for (ptx = 0; ptx < NPTENTRIES; ptx++)
+			if ((dpt[ptx] & PTE_P) &&
+			    (pp = pa2page(PTE_ADDR(dpt[ptx]))) != zero_page)
+				pp->pp_ref++;
+		spin_unlock(&page_lock);
+	}
+	tlb_batch_end();
+	return 0;
+
+nomem:
+	tlb_batch_end();
+	return -E_NO_MEM;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -514,9 +1064,15 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// With PTE_PS in perm, pp must be a block of order PAGE_LARGE_ORDER and
+// va a multiple of PTSIZE: the block is mapped as one 4MB page, which
+// replaces whatever was mapped in [va, va+PTSIZE).  A 4MB page at va
+// can't be replaced by a 4KB one, though; unmap it first.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if a 4MB page is in the way
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -524,10 +1080,14 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+	if (perm & PTE_PS)
+		return page_insert_large(pgdir, pp, va, perm);
+
 	// 获取va对应的页表的地址，如果还没分配，则先分配个物理页
 	pte_t *pte = pgdir_walk(pgdir, va, 1);
 	if (pte == NULL) return -E_NO_MEM;
-	pp->pp_ref++;
+	if (*pte & PTE_PS) return -E_INVAL;
+	page_incref(pp);
 	if ((*pte) & PTE_P) { // 如果该地址已经被映射过，则释放
 		page_remove(pgdir, va);
 	}
@@ -538,6 +1098,127 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Resolve a user page fault at va in pgdir if the kernel can: the first
+// touch of a demand-zero page (see page_reserve), or a write to a
+// copy-on-write page.  write says whether the access was a write.  The
+// caller must hold the address space lock.
+//
+// A read of a demand-zero page maps zero_page copy-on-write, so the page
+// only gets memory of its own once written to.  A write to a
+// copy-on-write page gets a private copy of the page, or just makes it
+// writable if nobody else maps it any more.
+//
+// RETURNS:
+//   0 if the access can be retried, which includes the case where another
+//     thread of the env got there first
+//   -E_INVAL, if the kernel can't resolve the fault
+//   -E_NO_MEM, if there's no memory for the page
+//
+int
+page_user_fault(pde_t *pgdir, void *va, int write)
+{
+	struct PageInfo *pp, *npp;
+	pte_t *pte;
+	int perm, r;
+
+	// Above UTOP the PDEs decide what the user may do (UVPT's PTEs have
+	// PTE_W, for one), so a fault there is never ours to resolve
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(pgdir, va, 0);
+	if (pte == NULL || (*pte & PTE_PS))
+		return -E_INVAL;
+
+	if (!(*pte & PTE_P)) {
+		if (!(*pte & PTE_ANON))
+			return -E_INVAL;
+		perm = (*pte & PTE_SYSCALL) | PTE_P;
+		if (write && !(perm & PTE_W))
+			return -E_INVAL;
+		// A PTE_SHARE page must be one page in every env that gets
+		// it, so it can't start out as zero_page.  (No TLB has a
+		// non-present PTE, so there is nothing to invalidate.)
+		if (!write && !(perm & PTE_SHARE)) {
+			if (perm & PTE_W)
+				perm = (perm & ~PTE_W) | PTE_COW;
+			*pte = page2pa(zero_page) | perm;
+			return 0;
+		}
+		if ((npp = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+		npp->pp_ref++;
+		*pte = page2pa(npp) | perm;
+		return 0;
+	}
+
+	if (!write || !(*pte & PTE_U))
+		return -E_INVAL;
+	if (*pte & PTE_W)
+		// Our TLB was stale
+		return 0;
+	if (!(*pte & PTE_COW))
+		return -E_INVAL;
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	// More references only come from mapping the page from this
+	// address space, which takes the lock we hold, so if we have the
+	// only one, we keep it.  zero_page's count says nothing.
+	if (pp != zero_page && pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (pp == zero_page)
+		npp = page_alloc(ALLOC_ZERO);
+	else if ((npp = page_alloc(0)) != NULL)
+		memcpy(page2kva(npp), page2kva(pp), PGSIZE);
+	if (npp == NULL)
+		return -E_NO_MEM;
+	if ((r = page_insert(pgdir, npp, va, perm)) < 0)
+		page_free(npp);
+	return r;
+}
+
+//
+// Reserve [va, va+len) in pgdir as demand-zero memory that will be mapped
+// with permissions perm: whatever is mapped there now is unmapped, and
+// each page only gets memory once it is touched (see page_user_fault).
+// va and len must be page-aligned.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//   -E_INVAL, if a 4MB page is in the way
+//
+int
+page_reserve(pde_t *pgdir, void *va, size_t len, int perm)
+{
+	uintptr_t a;
+	pte_t *pte;
+	int r = 0;
+
+	tlb_batch_begin();
+	for (a = (uintptr_t) va; a < (uintptr_t) va + len; a += PGSIZE) {
+		if ((pte = pgdir_walk(pgdir, (void *) a, 1)) == NULL) {
+			r = -E_NO_MEM;
+			break;
+		}
+		if (*pte & PTE_PS) {
+			r = -E_INVAL;
+			break;
+		}
+		if (*pte & PTE_P)
+			page_remove(pgdir, (void *) a);
+		*pte = (perm & PTE_SYSCALL & ~PTE_P) | PTE_ANON;
+	}
+	tlb_batch_end();
+	return r;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -547,6 +1228,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va lies in a 4MB page, this returns the first page of the block
+// and stores the address of the PDE.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 // 返回va对应的PTE所指向的物理地址对应的PageInfo结构地址。
 struct PageInfo *
@@ -555,7 +1239,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	struct PageInfo *pp;
 	pte_t *pte = pgdir_walk(pgdir, va, 0); // 这里如果不存在就不创建了
 	if (pte == NULL) return NULL; // 不存在
-	if (!(*pte) & PTE_P) return NULL; // 状态不是present
+	if (!(*pte & PTE_P)) return NULL; // 状态不是present
 	// 获取对应的物理地址并转化为PageInfo
 	physaddr_t pa = PTE_ADDR(*pte);
 	pp = pa2page(pa);
@@ -568,6 +1252,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If va lies in a 4MB page, the whole 4MB page is unmapped.
+// A demand-zero reservation of va is dropped too.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -586,22 +1272,210 @@ page_remove(pde_t *pgdir, void *va)
 	// 获取va对应的PTE的地址以及pp结构
 	pte_t *pte_store;
 	struct PageInfo *pp = page_lookup(pgdir, va, &pte_store);
-	if (pp == NULL) return; // 如果还没映射就不用解除
-	page_decref(pp);    //将pp->pp_ref减1，如果pp->pp_ref为0，需要释放该PageInfo结构（将其放入page_free_list链表中）
+	if (pp == NULL) { // 如果还没映射就不用解除
+		// Non-present, so no TLB has it
+		if ((pte_store = pgdir_walk(pgdir, va, 0)) != NULL)
+			*pte_store = 0;
+		return;
+	}
 	*pte_store = 0;    //将PTE清空
-	tlb_invalidate(pgdir, va); //失效化TLB缓存
+	// Other CPUs may still reach the page through their TLBs, so its
+	// reference only goes away once they have all dropped the entry.
+	tlb_remove(pgdir, va, pp);
 }
 
+// --------------------------------------------------------------
+// TLB shootdowns.
+//
+// Every CPU records in cpu_pgdir which page directory it has loaded.
+// A CPU that changes or removes a PTE invalidates its own TLB entry,
+// then sends an IRQ_TLB IPI to every other CPU that has the same page
+// directory loaded -- that is, every CPU running a thread of the same
+// environment -- and waits until they have invalidated theirs.
+// Kernel mappings never change once the APs are up (and are PTE_G, so
+// that they survive the lcr3 of a context switch), so in practice
+// only user address spaces need this.
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// The kernel runs with interrupts disabled, so a CPU spinning on a
+// lock would never take the IPI.  Every spin loop therefore polls
+// tlb_shootdown_handler; see spin_lock.
 //
+// Between tlb_batch_begin and tlb_batch_end, invalidations and the
+// page references they release are queued up and sent TLB_BATCH at a
+// time.
+
+#define TLB_BATCH	16
+
+struct TlbBatch {
+	pde_t *pgdir;
+	int nva;
+	uintptr_t va[TLB_BATCH];
+	struct PageInfo *pp[TLB_BATCH];	// Released once va is shot down
+};
+
+static struct TlbBatch tlb_batches[NCPU];
+
+// The shootdown in progress.  Only one CPU sends at a time.
+static struct spinlock tlb_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "tlb_lock"
+#endif
+};
+static struct TlbBatch *volatile tlb_req;
+
+// Make every other CPU that has b->pgdir loaded invalidate b's
+// addresses, and wait until they have.
+static void
+tlb_shootdown(struct TlbBatch *b)
+{
+	struct CpuInfo *c, *self = thiscpu;
+
+	// Our PTE updates must be visible before we look at cpu_pgdir.  A
+	// CPU that loads b->pgdir after we looked picks them up with the
+	// lcr3 (see pmap_switch).
+	__sync_synchronize();
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != self && c->cpu_pgdir == b->pgdir)
+			break;
+	if (c == cpus + ncpu)
+		return;
+
+	spin_lock(&tlb_lock);
+	tlb_req = b;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != self && c->cpu_pgdir == b->pgdir) {
+			c->cpu_tlb_pending = 1;
+			lapic_ipi_cpu(c - cpus, IRQ_OFFSET + IRQ_TLB);
+		}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_pending)
+			asm volatile("pause");
+	tlb_req = NULL;
+	spin_unlock(&tlb_lock);
+}
+
+// Carry out the shootdown aimed at this CPU, if there is one.
 void
-tlb_invalidate(pde_t *pgdir, void *va)
+tlb_shootdown_handler(void)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	struct CpuInfo *c = thiscpu;
+	struct TlbBatch *b;
+	int i;
+
+	if (!c->cpu_tlb_pending)
+		return;
+	// We may have switched away from b->pgdir since, in which case
+	// the lcr3 already took care of it.
+	b = tlb_req;
+	if (c->cpu_pgdir == b->pgdir)
+		for (i = 0; i < b->nva; i++)
+			invlpg((void *) b->va[i]);
+	c->cpu_tlb_pending = 0;
+}
+
+static void
+tlb_batch_flush(struct TlbBatch *b)
+{
+	int i;
+
+	tlb_shootdown(b);
+	for (i = 0; i < b->nva; i++)
+		if (b->pp[i])
+			page_decref(b->pp[i]);
+	b->nva = 0;
+}
+
+// Invalidate va in pgdir on every CPU, then drop a reference to pp
+// (if not NULL).  Inside a batch this may happen later.
+static void
+tlb_remove(pde_t *pgdir, void *va, struct PageInfo *pp)
+{
+	struct TlbBatch *b = thiscpu->cpu_tlb_batch, one;
+
+	if (rcr3() == PADDR(pgdir))
 		invlpg(va);
+
+	if (!b) {
+		one.pgdir = pgdir;
+		one.nva = 1;
+		one.va[0] = (uintptr_t) va;
+		tlb_shootdown(&one);
+		if (pp)
+			page_decref(pp);
+		return;
+	}
+
+	if (b->nva == TLB_BATCH || (b->nva && b->pgdir != pgdir))
+		tlb_batch_flush(b);
+	b->pgdir = pgdir;
+	b->va[b->nva] = (uintptr_t) va;
+	b->pp[b->nva] = pp;
+	b->nva++;
+}
+
+//
+// Invalidate a TLB entry on every CPU that is using the page tables
+// being edited.
+//
+void
+tlb_invalidate(pde_t *pgdir, void *va)
+{
+	tlb_remove(pgdir, va, NULL);
+}
+
+// Start deferring shootdowns on this CPU until tlb_batch_end.  Pages
+// unmapped in the meantime stay allocated until then.
+void
+tlb_batch_begin(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	assert(!c->cpu_tlb_batch);
+	c->cpu_tlb_batch = &tlb_batches[c - cpus];
+	c->cpu_tlb_batch->nva = 0;
+}
+
+void
+tlb_batch_end(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	assert(c->cpu_tlb_batch);
+	tlb_batch_flush(c->cpu_tlb_batch);
+	c->cpu_tlb_batch = NULL;
+}
+
+// Load pgdir (kern_pgdir if NULL) into CR3 unless it is already
+// there, as it is when switching between threads of one environment.
+void
+pmap_switch(pde_t *pgdir)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (!pgdir)
+		pgdir = kern_pgdir;
+	if (c->cpu_pgdir == pgdir)
+		return;
+	// lcr3 serializes, so cpu_pgdir is visible to tlb_shootdown
+	// before we start walking pgdir.
+	c->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
+}
+
+// Wait until no CPU has pgdir loaded, so that it can be freed.  Other
+// CPUs can only have it loaded while switching away from it.
+void
+pmap_wait_unloaded(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+
+	if (thiscpu->cpu_pgdir == pgdir)
+		pmap_switch(NULL);
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_pgdir == pgdir) {
+			tlb_shootdown_handler();
+			asm volatile("pause");
+		}
 }
 
 //
@@ -645,7 +1519,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 		panic("mmio_map_region: Out of memory\n");
 	}
 	// 做映射
-	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W);
+	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 	// 更新base
 	base += size;
 	return (void*)(base - size);
@@ -671,6 +1545,11 @@ static uintptr_t user_mem_check_addr;
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
+// Untouched demand-zero pages get mapped on the way, and copy-on-write
+// pages copied if perm has PTE_W, as they would be if the user accessed
+// them itself.  That changes env's page tables, so the caller must hold
+// env's env_vm_lock.
+//
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
@@ -681,6 +1560,8 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	uint32_t i;
 	for (i = (uint32_t)begin; i < end; i += PGSIZE) {
 		pte_t *pte = pgdir_walk(env->env_pgdir, (void*)i, 0);
+		if (i < ULIM && pte && (*pte & (perm | PTE_P)) != (perm | PTE_P))
+			page_user_fault(env->env_pgdir, (void *) i, perm & PTE_W);
 		if ((i >= ULIM) || !pte || !(*pte & PTE_P) || ((*pte & perm) != perm)) { //具体检测规则
 			user_mem_check_addr = (i < (uint32_t)va ? (uint32_t)va : i);  //记录无效的那个线性地址
 			return -E_FAULT;
@@ -697,11 +1578,17 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// Takes env's env_vm_lock, which the caller must not hold.
 // 内存范围检查，防止用户态程序访问内核
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+	int r;
+
+	spin_lock(&env->env_vm_lock);
+	r = user_mem_check(env, va, len, perm | PTE_U);
+	spin_unlock(&env->env_vm_lock);
+	if (r < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);	// may not return
@@ -713,48 +1600,48 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Visit every page of every free block.
+#define FOR_EACH_FREE_PAGE(pp, blk, o)					\
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)				\
+		for (blk = page_free_area[o]; blk; blk = blk->pp_link)	\
+			for (pp = blk; pp < blk + (1 << o); pp++)
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int o;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		// 将低地址放在page_free_list前面
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	for (o = 0; o <= PAGE_MAX_ORDER && !page_free_area[o]; o++)
+		;
+	if (o > PAGE_MAX_ORDER)
+		panic("the free lists are empty!");
+
+	// With only_low_memory, entry_pgdir does not map all pages; the
+	// allocator does not hand out the rest until kern_pgdir is loaded.
+	if (only_low_memory)
+		assert(page_alloc_limit <= PGNUM(PTSIZE));
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
+	FOR_EACH_FREE_PAGE(pp, blk, o)
 		if (PDX(page2pa(pp)) < pdx_limit)
 			memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
+	FOR_EACH_FREE_PAGE(pp, blk, o) {
 		// check that we didn't corrupt the free list itself
 		assert(pp >= pages);
 		assert(pp < pages + npages);
 		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+		assert((blk - pages) % (1 << o) == 0);
+		assert(blk->pp_free && blk->pp_order == o);
 
 		// check a few pages that shouldn't be on the free list
 		assert(page2pa(pp) != 0);
@@ -777,6 +1664,48 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list() succeeded!\n");
 }
 
+// Count the free pages.
+static int
+check_nfree(void)
+{
+	int nfree = 0, o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		nfree += page_free_blocks[o] << o;
+	for (o = 0; o < NCPU; o++)
+		nfree += page_mags[o].n;
+	return nfree + page_zero_count;
+}
+
+// Allocate every free block and return them linked through pp_link, so
+// that a check can run with the allocator empty.
+static struct PageInfo *
+check_steal_free(void)
+{
+	struct PageInfo *fl = NULL, *pp;
+	int o;
+
+	for (o = PAGE_MAX_ORDER; o >= 0; o--)
+		while ((pp = page_alloc_order(0, o)) != NULL) {
+			pp->pp_link = fl;
+			fl = pp;
+		}
+	return fl;
+}
+
+// Free the blocks that check_steal_free took.
+static void
+check_return_free(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl) != NULL) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_order(pp, pp->pp_order);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -794,8 +1723,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -811,8 +1739,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -840,17 +1767,24 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// a multi-page block is aligned to its size and merges back
+	assert((pp = page_alloc_order(ALLOC_ZERO, 3)));
+	assert((pp - pages) % 8 == 0);
+	c = page2kva(pp);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(check_nfree() == nfree - 8);
+	page_free_order(pp, 3);
+
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -876,10 +1810,12 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
+	// check envs array (new test for lab 3): the user sees the same
+	// pages as the kernel
+	n = ROUNDUP(UENVS_SIZE, PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+		assert(check_va2pa(pgdir, UENVS + i) == check_va2pa(pgdir, KENVS + i));
+	assert(check_va2pa(pgdir, (uintptr_t) envtabs) != ~0);
 
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
@@ -903,6 +1839,7 @@ check_kern_pgdir(void)
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
 		case PDX(UENVS):
+		case PDX(KENVS):
 		case PDX(MMIOBASE):
 			assert(pgdir[i] & PTE_P);
 			break;
@@ -931,6 +1868,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -961,8 +1900,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1082,7 +2020,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
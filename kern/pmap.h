@@ -51,17 +51,38 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The largest block the page allocator hands out is 1 << PAGE_MAX_ORDER
+// pages (4MB).
+#define PAGE_MAX_ORDER	10
+// Blocks of this order back 4MB (PTE_PS) mappings
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int alloc_flags, int order);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_print_free(void);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_user_fault(pde_t *pgdir, void *va, int write);
+int	page_reserve(pde_t *pgdir, void *va, size_t len, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
+
+int	pmap_map_envs(size_t start, size_t end);
+int	pmap_fork(pde_t *src, pde_t *dst);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_handler(void);
+void	pmap_switch(pde_t *pgdir);
+void	pmap_wait_unloaded(pde_t *pgdir);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -5,6 +5,14 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Keeps the output of concurrent cprintf calls from interleaving.
+static struct spinlock print_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "print_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +24,16 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern char *panicstr;
 	int cnt = 0;
+	// Don't wait for a lock the panicking CPU may never release
+	bool locked = !panicstr;
 
+	if (locked)
+		spin_lock(&print_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		spin_unlock(&print_lock);
 	return cnt;
 }
 
@@ -4,91 +4,687 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/time.h>
+#include <kern/futex.h>
 
 void sched_halt(void);
 
-// Choose a user environment to run and run it.
+// Each CPU keeps a queue of the threads that are ready to run on it
+// (thd_status == THD_RUNNABLE in an ENV_RUNNABLE env).  A thread joins the
+// queue of the CPU it last ran on when it becomes runnable and leaves it
+// when it is picked, blocked or freed, so the scheduler never has to look
+// at threads that cannot run.  A CPU whose own queue is empty steals from
+// the CPU with the longest queue.
+//
+// The queue is kept sorted by virtual runtime: the CPU time a thread has
+// used, scaled by 1024 / weight, where the weight follows from the
+// thread's priority.  Always running the thread with the smallest
+// vruntime gives every thread a share of the CPU proportional to its
+// weight.  A thread that has been asleep comes back with its vruntime
+// raised to near the CPU's cpu_min_vruntime, so sleeping does not bank
+// unlimited credit.
+//
+// Every thread belongs to the CPU named by its thd_cpunum, and that CPU's
+// cpu_rq_lock protects the thread's status and queue linkage.  A thread
+// only runs on the CPU it belongs to; stealing moves it to the thief while
+// holding both queue locks.  Lock order is by CPU number.
+//
+// A thread stays with the CPU it last ran on, whose cache it has warmed,
+// unless that CPU is busy and another one idle.  Even then a thread that
+// left its CPU less than SCHED_CACHE_HOT_US ago is only stolen if its
+// CPU has more than one thread waiting.  thd_affinity limits the CPUs a
+// thread may belong to at all.
+//
+// Threads in sys_thd_sleep wait on a single sleep queue sorted by wakeup
+// time.  Whichever CPU next enters the scheduler after a deadline passes
+// wakes the thread, and CPUs arm their one-shot timer for no later than
+// the first deadline.  sleep_lock is taken after the futex bucket locks
+// (see kern/futex.c) and before any run queue lock.
+//
+// Each thread accumulates the cycles it ran, the cycles it spent waiting
+// in a run queue, and how often it was switched to and migrated; each
+// CPU its busy and idle cycles in cpustats.  All of it is readable by
+// user programs and by the monitor's top command.
+
+// Mapped read-only at UCPUSTATS, protected by the CPU's cpu_rq_lock
+struct CpuStat *cpustats;
+
+// Sleeping threads, earliest wakeup first
+static struct Thd *sleep_head;
+static struct spinlock sleep_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sleep_lock"
+#endif
+};
+
+// Scaling factors for vruntime, THD_PRIO_MIN first: 2^32 / weight, where
+// the weight is 1024 at THD_PRIO_DEFAULT and grows by a factor of 1.25
+// per step towards THD_PRIO_MIN.  Multiplying by these and shifting
+// avoids a 64-bit division.
+static const uint32_t prio_to_wmult[THD_PRIO_MAX - THD_PRIO_MIN + 1] = {
+	    48388,     59856,     76040,     92818,    118348,
+	   147320,    184698,    229616,    287308,    360437,
+	   449829,    563644,    704093,    875809,   1099582,
+	  1376151,   1717300,   2157191,   2708050,   3363326,
+	  4194304,   5237765,   6557202,   8165337,  10153587,
+	 12820798,  15790321,  19976592,  24970740,  31350126,
+	 39045157,  49367440,  61356676,  76695844,  95443717,
+	119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
+// How long a thread runs before the timer gives the others a turn.
+// Only CPUs that are running a thread arm the timer; an idle CPU sleeps
+// until an interrupt or another CPU's IPI (see sched_kick) wakes it.
+#define SCHED_SLICE_US		10000
+
+// See sched_steal
+#define SCHED_CACHE_HOT_US	500
+
+#define CPUMASK(c)		(1u << ((c) - cpus))
+
+// How far behind cpu_min_vruntime a waking thread may start, in cycles
+// of virtual runtime.  Lets interactive threads preempt CPU hogs.
+#define SCHED_WAKEUP_CREDIT	(1 << 22)
+
+// Lock and return the CPU that owns t.
+struct CpuInfo *
+sched_lock_thd(struct Thd *t)
+{
+	struct CpuInfo *c;
+
+	// t may be stolen by another CPU while we wait for the lock
+	while (1) {
+		c = &cpus[t->thd_cpunum];
+		spin_lock(&c->cpu_rq_lock);
+		if (c == &cpus[t->thd_cpunum])
+			return c;
+		spin_unlock(&c->cpu_rq_lock);
+	}
+}
+
+// Insert t into c's run queue, in vruntime order, if it can run.
+// Returns whether it did.  c must be t's CPU and be locked.
+static bool
+rq_insert(struct CpuInfo *c, struct Thd *t)
+{
+	struct Thd *prev;
+
+	if (t->thd_rq_cpu >= 0 || t->thd_status != THD_RUNNABLE ||
+	    t->thd_env->env_status != ENV_RUNNABLE)
+		return 0;
+	// Waiting for sched_rehome to move it
+	if (!(t->thd_affinity & CPUMASK(c)))
+		return 0;
+
+	if (t->thd_vruntime + SCHED_WAKEUP_CREDIT < c->cpu_min_vruntime)
+		t->thd_vruntime = c->cpu_min_vruntime - SCHED_WAKEUP_CREDIT;
+
+	// Behind every thread with the same vruntime, so that equal
+	// threads take turns.  Search from the tail: a thread that was
+	// just preempted usually belongs near the end.
+	for (prev = c->cpu_rq_tail; prev; prev = prev->thd_rq_prev)
+		if (prev->thd_vruntime <= t->thd_vruntime)
+			break;
+
+	t->thd_rq_prev = prev;
+	t->thd_rq_next = prev ? prev->thd_rq_next : c->cpu_rq_head;
+	if (t->thd_rq_next)
+		t->thd_rq_next->thd_rq_prev = t;
+	else
+		c->cpu_rq_tail = t;
+	if (prev)
+		prev->thd_rq_next = t;
+	else
+		c->cpu_rq_head = t;
+	c->cpu_rq_len++;
+	t->thd_rq_cpu = c - cpus;
+	t->thd_queued_at = read_tsc();
+	return 1;
+}
+
+// Unlink t from c's run queue, if it is on it.  c must be locked.
+static void
+rq_remove(struct CpuInfo *c, struct Thd *t)
+{
+	if (t->thd_rq_cpu < 0)
+		return;
+
+	if (t->thd_rq_prev)
+		t->thd_rq_prev->thd_rq_next = t->thd_rq_next;
+	else
+		c->cpu_rq_head = t->thd_rq_next;
+	if (t->thd_rq_next)
+		t->thd_rq_next->thd_rq_prev = t->thd_rq_prev;
+	else
+		c->cpu_rq_tail = t->thd_rq_prev;
+	t->thd_rq_prev = t->thd_rq_next = NULL;
+	t->thd_rq_cpu = -1;
+	c->cpu_rq_len--;
+	t->thd_wait_time += read_tsc() - t->thd_queued_at;
+}
+
+// Take the first thread off c's run queue, or return NULL if it is empty.
+static struct Thd *
+rq_pop(struct CpuInfo *c)
+{
+	struct Thd *t;
+
+	if ((t = c->cpu_rq_head) != NULL)
+		rq_remove(c, t);
+	return t;
+}
+
+// t is moving from CPU 'from' to CPU 'to': keep its place relative to
+// the other threads, as its lag behind or ahead of from's
+// cpu_min_vruntime.  The lag is signed; a thread far behind gets no
+// more credit than a waking one (see rq_insert).
+static void
+rq_move_vruntime(struct Thd *t, struct CpuInfo *from, struct CpuInfo *to)
+{
+	int64_t lag = (int64_t) (t->thd_vruntime - from->cpu_min_vruntime);
+
+	if (lag < -SCHED_WAKEUP_CREDIT)
+		lag = -SCHED_WAKEUP_CREDIT;
+	if (lag < 0 && (uint64_t) -lag > to->cpu_min_vruntime)
+		lag = -(int64_t) to->cpu_min_vruntime;
+	t->thd_vruntime = to->cpu_min_vruntime + lag;
+}
+
+// Work was just queued on c.  Busy CPUs look at their queues at least
+// once per time slice, but halted CPUs take no timer interrupts, so
+// wake one: c itself if it is halted, otherwise any halted CPU, which
+// will steal the work.  c must not be locked.
+static void
+sched_kick(struct CpuInfo *c)
+{
+	struct CpuInfo *v;
+
+	if (c->cpu_status != CPU_HALTED)
+		for (v = cpus; v < cpus + ncpu; v++)
+			if (v != thiscpu && v->cpu_status == CPU_HALTED) {
+				c = v;
+				break;
+			}
+	if (c != thiscpu && c->cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(c - cpus, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Queue t on its CPU if it is runnable and not queued yet.
+void
+sched_enqueue(struct Thd *t)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+	bool queued = rq_insert(c, t);
+
+	spin_unlock(&c->cpu_rq_lock);
+	if (queued)
+		sched_kick(c);
+}
+
+// Remove t from its CPU's run queue, if it is on it.
+void
+sched_dequeue(struct Thd *t)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+
+	rq_remove(c, t);
+	spin_unlock(&c->cpu_rq_lock);
+}
+
+// Make a THD_NOT_RUNNABLE thread runnable and queue it.
+// Threads in any other state are left alone.
+void
+sched_wakeup(struct Thd *t)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+	bool queued = 0;
+
+	if (t->thd_status == THD_NOT_RUNNABLE) {
+		t->thd_status = THD_RUNNABLE;
+		queued = rq_insert(c, t);
+	}
+	spin_unlock(&c->cpu_rq_lock);
+	if (queued)
+		sched_kick(c);
+}
+
+// Mark t THD_NOT_RUNNABLE.  If t is running, its CPU gives it up the
+// next time it enters the scheduler.
+void
+sched_block(struct Thd *t)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+
+	if (t->thd_status == THD_RUNNABLE || t->thd_status == THD_RUNNING) {
+		rq_remove(c, t);
+		t->thd_status = THD_NOT_RUNNABLE;
+	}
+	spin_unlock(&c->cpu_rq_lock);
+}
+
+// Change t's priority.  Its queue position stays valid because the
+// weight only affects how fast vruntime grows from now on.
+void
+sched_set_priority(struct Thd *t, int prio)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+
+	t->thd_priority = prio;
+	spin_unlock(&c->cpu_rq_lock);
+}
+
+// Remove t from the sleep queue.  sleep_lock must be held.
+static void
+sleep_remove(struct Thd *t)
+{
+	if (t->thd_sleep_prev)
+		t->thd_sleep_prev->thd_sleep_next = t->thd_sleep_next;
+	else
+		sleep_head = t->thd_sleep_next;
+	if (t->thd_sleep_next)
+		t->thd_sleep_next->thd_sleep_prev = t->thd_sleep_prev;
+	t->thd_sleep_prev = t->thd_sleep_next = NULL;
+	t->thd_wakeup = 0;
+}
+
+// Move t to a CPU its affinity allows, if the CPU that owns it is not
+// one of them.  A thread that its CPU is still running is left alone;
+// that CPU moves it the next time it enters the scheduler.
+static void
+sched_rehome(struct Thd *t)
+{
+	struct CpuInfo *c, *d = NULL, *v;
+	bool queued;
+
+	// Unlocked peek for the allowed CPU with the shortest queue
+	for (v = cpus; v < cpus + ncpu; v++)
+		if ((t->thd_affinity & CPUMASK(v)) &&
+		    (!d || v->cpu_rq_len < d->cpu_rq_len))
+			d = v;
+	if (!d)
+		return;
+
+	// Lock t's CPU and d, in CPU order
+	while (1) {
+		c = &cpus[t->thd_cpunum];
+		spin_lock(&(c < d ? c : d)->cpu_rq_lock);
+		if (c != d)
+			spin_lock(&(c < d ? d : c)->cpu_rq_lock);
+		if (c == &cpus[t->thd_cpunum])
+			break;
+		if (c != d)
+			spin_unlock(&c->cpu_rq_lock);
+		spin_unlock(&d->cpu_rq_lock);
+	}
+
+	queued = 0;
+	if (c != d && t->thd_status != THD_FREE && c->cpu_thd != t &&
+	    !(t->thd_affinity & CPUMASK(c))) {
+		rq_remove(c, t);
+		t->thd_cpunum = d - cpus;
+		t->thd_migrations++;
+		rq_move_vruntime(t, c, d);
+		queued = rq_insert(d, t);
+	}
+	if (c != d)
+		spin_unlock(&c->cpu_rq_lock);
+	spin_unlock(&d->cpu_rq_lock);
+	if (queued)
+		sched_kick(d);
+}
+
+// Restrict t to the CPUs in cpumask, moving it if need be.
+void
+sched_set_affinity(struct Thd *t, uint32_t cpumask)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+
+	t->thd_affinity = cpumask;
+	spin_unlock(&c->cpu_rq_lock);
+	sched_rehome(t);
+}
+
+// Block t until msec milliseconds from now.  If futex is set, t waits
+// on a futex as well and futex_timeout wakes it instead.
+void
+sched_sleep(struct Thd *t, uint32_t msec, bool futex)
+{
+	struct Thd *prev = NULL, *next;
+
+	spin_lock(&sleep_lock);
+	if (t->thd_wakeup)
+		sleep_remove(t);
+	t->thd_wakeup = read_tsc() + (uint64_t) msec * time_tsc_per_ms();
+	t->thd_sleep_futex = futex;
+	for (next = sleep_head; next; prev = next, next = next->thd_sleep_next)
+		if (next->thd_wakeup > t->thd_wakeup)
+			break;
+	t->thd_sleep_prev = prev;
+	t->thd_sleep_next = next;
+	if (prev)
+		prev->thd_sleep_next = t;
+	else
+		sleep_head = t;
+	if (next)
+		next->thd_sleep_prev = t;
+	sched_block(t);
+	spin_unlock(&sleep_lock);
+}
+
+// Take t off the sleep queue, if it is on it, without waking it.
+void
+sched_cancel_sleep(struct Thd *t)
+{
+	spin_lock(&sleep_lock);
+	if (t->thd_wakeup)
+		sleep_remove(t);
+	spin_unlock(&sleep_lock);
+}
+
+// Wake every sleeper whose deadline has passed.
+static void
+sleep_expire(void)
+{
+	uint64_t now = read_tsc();
+	struct Thd *t, *futex[8];
+	uint32_t seq[8];
+	int i, n;
+
+	do {
+		// Unlocked peek to keep the common case cheap
+		if (!sleep_head)
+			return;
+		// Futex bucket locks come before sleep_lock, so timed-out
+		// futex waiters are handed to futex_timeout afterwards.
+		n = 0;
+		spin_lock(&sleep_lock);
+		while ((t = sleep_head) && t->thd_wakeup <= now &&
+		       n < ARRAY_SIZE(futex)) {
+			sleep_remove(t);
+			if (t->thd_sleep_futex) {
+				futex[n] = t;
+				seq[n++] = t->thd_futex_seq;
+			} else
+				sched_wakeup(t);
+		}
+		spin_unlock(&sleep_lock);
+		for (i = 0; i < n; i++)
+			futex_timeout(futex[i], seq[i]);
+	} while (n == ARRAY_SIZE(futex));
+}
+
+// Microseconds until the first sleeper is due (at least 1), or 0 if
+// nobody is sleeping.
+static uint32_t
+sleep_next_usec(void)
+{
+	uint64_t now = read_tsc(), usec = 0;
+
+	if (!sleep_head)
+		return 0;
+	spin_lock(&sleep_lock);
+	if (sleep_head) {
+		if (sleep_head->thd_wakeup > now)
+			usec = (sleep_head->thd_wakeup - now) * 1000 /
+			       time_tsc_per_ms();
+		if (usec == 0)
+			usec = 1;
+		else if (usec > 0xffffffff)
+			usec = 0xffffffff;
+	}
+	spin_unlock(&sleep_lock);
+	return usec;
+}
+
+// Charge the thread running on c, or c's idle time if t is NULL, for the
+// time since c->cpu_exec_start.  c must be locked.
+static void
+sched_account(struct CpuInfo *c, struct Thd *t)
+{
+	uint64_t now = read_tsc(), delta = now - c->cpu_exec_start;
+	struct CpuStat *cs = &cpustats[c - cpus];
+	uint32_t wmult;
+
+	c->cpu_exec_start = now;
+	if (!t) {
+		cs->cs_idle += delta;
+		return;
+	}
+	cs->cs_busy += delta;
+	wmult = prio_to_wmult[t->thd_priority - THD_PRIO_MIN];
+	t->thd_last_ran = now;
+	// Keep the product below within 64 bits
+	if (delta > 0xffffffff)
+		delta = 0xffffffff;
+	t->thd_runtime += delta;
+	t->thd_vruntime += (delta * wmult) >> 22;
+}
+
+// Take t away from the scheduler so that it can be freed, and return 1.
+// If t is still in use by another CPU, mark it THD_DYING instead and
+// return 0; that CPU frees it the next time it enters the kernel.
+int
+sched_detach(struct Thd *t)
+{
+	struct CpuInfo *c = sched_lock_thd(t);
+	int r = 1;
+
+	rq_remove(c, t);
+	if (c != thiscpu && c->cpu_thd == t) {
+		t->thd_status = THD_DYING;
+		r = 0;
+	} else
+		t->thd_status = THD_FREE;
+	spin_unlock(&c->cpu_rq_lock);
+	return r;
+}
+
+// Our own queue is empty: take the first thread from the busiest CPU.
+// Called and returns with c's queue locked.
+static struct Thd *
+sched_steal(struct CpuInfo *c)
+{
+	struct CpuInfo *v, *victim = NULL;
+	struct Thd *t, *hot;
+	uint64_t now, hot_cycles;
+
+	// Unlocked peek; we check again once the victim is locked
+	for (v = cpus; v < cpus + ncpu; v++)
+		if (v != c && v->cpu_rq_len > 0 &&
+		    (!victim || v->cpu_rq_len > victim->cpu_rq_len))
+			victim = v;
+	if (!victim)
+		return NULL;
+
+	if (victim < c) {
+		spin_unlock(&c->cpu_rq_lock);
+		spin_lock(&victim->cpu_rq_lock);
+		spin_lock(&c->cpu_rq_lock);
+	} else
+		spin_lock(&victim->cpu_rq_lock);
+
+	// Something may have been queued here while c was unlocked
+	if ((t = rq_pop(c)) == NULL) {
+		now = read_tsc();
+		hot_cycles = (uint64_t) time_tsc_per_ms() * SCHED_CACHE_HOT_US / 1000;
+		hot = NULL;
+		for (t = victim->cpu_rq_head; t; t = t->thd_rq_next) {
+			// A blocked thread can be woken before its CPU has
+			// switched away from it; leave that one where it is.
+			if (t == victim->cpu_thd || !(t->thd_affinity & CPUMASK(c)))
+				continue;
+			if (now - t->thd_last_ran >= hot_cycles)
+				break;
+			if (!hot)
+				hot = t;
+		}
+		// A cache-hot thread is better off waiting for its own CPU,
+		// unless that CPU has a backlog anyway.
+		if (!t && victim->cpu_rq_len > 1)
+			t = hot;
+		if (t) {
+			rq_remove(victim, t);
+			t->thd_cpunum = c - cpus;
+			t->thd_migrations++;
+			cpustats[c - cpus].cs_steals++;
+			rq_move_vruntime(t, victim, c);
+		}
+	}
+	spin_unlock(&victim->cpu_rq_lock);
+	return t;
+}
+
+// Choose a user thread to run and run it.
 void
 sched_yield(void)
 {
-	struct Thd *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	// 这里的基本单位改成Thd，重写一遍吧
-	
-	struct Thd *cur = curthd;
-	if (cur == NULL) {
-		for(idle = thds; idle != thds + NTHD; idle++)
-			if (idle->thd_status == THD_RUNNABLE && idle->thd_env->env_status == ENV_RUNNABLE)
-				thd_run(idle);
+	struct CpuInfo *c = thiscpu;
+	struct Thd *cur = curthd, *t, *rehome = NULL;
+	struct Env *e;
+	uint32_t usec;
+
+	sleep_expire();
+	spin_lock(&c->cpu_rq_lock);
+	sched_account(c, cur);
+
+	// Someone destroyed the current thread while it was running.
+	if (cur && cur->thd_status == THD_DYING) {
+		spin_unlock(&c->cpu_rq_lock);
+		e = cur->thd_env;
+		if (thd_free(cur))
+			env_free(e);
+		curthd = cur = NULL;
+		spin_lock(&c->cpu_rq_lock);
 	}
-	else {
-		// 从现在找到末尾
-		for(idle = cur + 1; idle != thds + NTHD; idle++)
-			if (idle->thd_status == THD_RUNNABLE && idle->thd_env->env_status == ENV_RUNNABLE)
-				thd_run(idle);
-		// 没找到就从头找到现在
-		for(idle = thds; idle != cur; idle++)
-			if (idle->thd_status == THD_RUNNABLE && idle->thd_env->env_status == ENV_RUNNABLE)
-				thd_run(idle);
-		// 都没有就看看现在的
-		if (cur->thd_status == THD_RUNNING && cur->thd_env->env_status == ENV_RUNNABLE)
-			thd_run(cur);
+
+	// Its affinity changed while it was running here
+	if (cur && !(cur->thd_affinity & CPUMASK(c)))
+		rehome = cur;
+
+	// A thread that is giving up the CPU while still runnable goes
+	// back into the queue by its new vruntime.  If nothing else is
+	// waiting it will simply be picked again.
+	if (cur && cur->thd_status == THD_RUNNING) {
+		cur->thd_status = THD_RUNNABLE;
+		rq_insert(c, cur);
 	}
+
+	if ((t = rq_pop(c)) != NULL || (t = sched_steal(c)) != NULL) {
+		if (t != cur) {
+			t->thd_runs++;
+			cpustats[c - cpus].cs_switches++;
+		}
+		if (t->thd_vruntime > c->cpu_min_vruntime)
+			c->cpu_min_vruntime = t->thd_vruntime;
+		c->cpu_exec_start = read_tsc();
+		t->thd_status = THD_RUNNING;
+		curthd = t;
+		spin_unlock(&c->cpu_rq_lock);
+		if (rehome)
+			sched_rehome(rehome);
+		usec = sleep_next_usec();
+		lapic_timer_set(usec && usec < SCHED_SLICE_US ?
+				usec : SCHED_SLICE_US);
+		thd_run(t);
+	}
+
 	// 如果实在找不到，就停机吧
+	// Mark that no environment is running on this CPU.  Do it under the
+	// queue lock so that anyone who queues work for us afterwards sees
+	// that we are halted.
+	pmap_switch(NULL);
+	curthd = NULL;
+	xchg(&c->cpu_status, CPU_HALTED);
+	spin_unlock(&c->cpu_rq_lock);
+	if (rehome)
+		sched_rehome(rehome);
+	// Stay asleep unless a sleeping thread is due
+	lapic_timer_set(sleep_next_usec());
+
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Wake t, a THD_NOT_RUNNABLE thread, and run it right away in place of
+// the current thread, which has just blocked or is giving up the CPU.
+// This is how a thread passes control to its IPC partner: skipping the
+// run queue saves the scheduling decision, and the partner runs on the
+// CPU whose cache holds the message.  If t belongs to another CPU or
+// can't run here, it is simply woken and we call sched_yield.
+void
+sched_handoff(struct Thd *t)
+{
+	struct CpuInfo *c = thiscpu;
+	struct Thd *cur = curthd;
+	uint32_t usec;
+
+	spin_lock(&c->cpu_rq_lock);
+	// Only this CPU can change t's thd_cpunum to or from ours
+	if (!cur || cur->thd_status == THD_DYING ||
+	    !(cur->thd_affinity & CPUMASK(c)) ||
+	    t->thd_cpunum != c - cpus || t->thd_status != THD_NOT_RUNNABLE ||
+	    t->thd_env->env_status != ENV_RUNNABLE ||
+	    !(t->thd_affinity & CPUMASK(c))) {
+		spin_unlock(&c->cpu_rq_lock);
+		sched_wakeup(t);
+		sched_yield();
+	}
+
+	sched_account(c, cur);
+	if (cur->thd_status == THD_RUNNING) {
+		cur->thd_status = THD_RUNNABLE;
+		rq_insert(c, cur);
+	}
+
+	// As if t had been queued and picked at once
+	if (t->thd_vruntime + SCHED_WAKEUP_CREDIT < c->cpu_min_vruntime)
+		t->thd_vruntime = c->cpu_min_vruntime - SCHED_WAKEUP_CREDIT;
+	if (t->thd_vruntime > c->cpu_min_vruntime)
+		c->cpu_min_vruntime = t->thd_vruntime;
+	t->thd_runs++;
+	cpustats[c - cpus].cs_switches++;
+	cpustats[c - cpus].cs_handoffs++;
+	c->cpu_exec_start = read_tsc();
+	t->thd_status = THD_RUNNING;
+	curthd = t;
+	spin_unlock(&c->cpu_rq_lock);
+	usec = sleep_next_usec();
+	lapic_timer_set(usec && usec < SCHED_SLICE_US ? usec : SCHED_SLICE_US);
+	thd_run(t);
+}
+
+// Halt this CPU when there is nothing to do. Wait until an interrupt
+// wakes it up. This function never returns.
 //
 void
 sched_halt(void)
 {
-	int i;
+	struct CpuInfo *c;
+	bool busy = 0;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NTHD; i++) {
-		if ((thds[i].thd_status == THD_RUNNABLE ||
-		     thds[i].thd_status == THD_RUNNING ||
-		     thds[i].thd_status == THD_DYING))
-			break;
-	}
-	if (i == NTHD) {
+	// Every runnable thread is either queued or running on some CPU;
+	// take all the queue locks so threads in flight between two CPUs
+	// are seen on one of them.  Sleeping threads will run again too.
+	spin_lock(&sleep_lock);
+	for (c = cpus; c < cpus + ncpu; c++)
+		spin_lock(&c->cpu_rq_lock);
+	busy = (sleep_head != NULL);
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c->cpu_rq_len > 0 || c->cpu_thd)
+			busy = 1;
+	for (c = cpus; c < cpus + ncpu; c++)
+		spin_unlock(&c->cpu_rq_lock);
+	spin_unlock(&sleep_lock);
+	if (!busy) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curthd = NULL;
-	lcr3(PADDR(kern_pgdir));
-
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
-	xchg(&thiscpu->cpu_status, CPU_HALTED);
-
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Put the idle time to use
+	page_zero_idle();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -104,3 +700,14 @@ sched_halt(void)
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
 
+// Set up the per-CPU run queues.
+void
+sched_init(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + NCPU; c++) {
+		__spin_initlock(&c->cpu_rq_lock, "cpu_rq_lock");
+		c->cpu_exec_start = read_tsc();
+	}
+}
@@ -6,7 +6,23 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Thd;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_init(void);
+void sched_enqueue(struct Thd *t);
+void sched_dequeue(struct Thd *t);
+void sched_wakeup(struct Thd *t);
+void sched_handoff(struct Thd *t) __attribute__((noreturn));
+void sched_block(struct Thd *t);
+void sched_set_priority(struct Thd *t, int prio);
+void sched_set_affinity(struct Thd *t, uint32_t cpumask);
+void sched_sleep(struct Thd *t, uint32_t msec, bool futex);
+void sched_cancel_sleep(struct Thd *t);
+int sched_detach(struct Thd *t);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -8,13 +8,8 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
-
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+#include <kern/pmap.h>
+#include <kern/time.h>
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -39,14 +34,18 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
+
+// Every lock that has been acquired at least once, for spin_dump
+static struct spinlock *spin_list;
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
+	lk->next = 0;
+	lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
@@ -60,21 +59,50 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	unsigned ticket;
 #ifdef DEBUG_SPINLOCK
+	uint64_t start;
+
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// Draw a ticket and wait for it to come up.  Waiters only read
+	// owner, so the cache line is not bounced between them while they
+	// spin, and the lock is handed out in first-come order.
+	// The xadd is atomic and serializes, so that reads after acquire
+	// are not reordered before it.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef DEBUG_SPINLOCK
+		start = read_tsc();
+#endif
+		// Interrupts are off, so keep answering TLB shootdowns while
+		// we wait: the CPU that holds lk may be waiting for us.
+		while (lk->owner != ticket) {
+			tlb_shootdown_handler();
+			asm volatile ("pause");
+		}
+#ifdef DEBUG_SPINLOCK
+		lk->contended++;
+		lk->spin_cycles += read_tsc() - start;
+#endif
+	}
+	asm volatile ("" : : : "memory");
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	lk->acquires++;
+	lk->acquired_at = read_tsc();
+	if (!lk->stats_listed) {
+		lk->stats_listed = 1;
+		do
+			lk->stats_next = spin_list;
+		while (!__sync_bool_compare_and_swap(&spin_list,
+						     lk->stats_next, lk));
+	}
 #endif
 }
 
@@ -83,6 +111,8 @@ void
 spin_unlock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
+	uint64_t hold;
+
 	if (!holding(lk)) {
 		int i;
 		uint32_t pcs[10];
@@ -103,14 +133,73 @@ spin_unlock(struct spinlock *lk)
 		panic("spin_unlock");
 	}
 
+	hold = read_tsc() - lk->acquired_at;
+	if (hold > lk->max_hold)
+		lk->max_hold = hold;
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	// Only the holder writes owner, so a plain store hands the lock to
+	// the next ticket.  x86 CPUs do not reorder stores with earlier
+	// loads or stores (vol 3, 8.2.2), and the compiler barrier keeps
+	// gcc from moving the critical section past it.
+	asm volatile ("" : : : "memory");
+	lk->owner++;
+}
+
+// Print the contention statistics of every lock that has been used,
+// summed over the locks of each name (such as every env's env_vm_lock),
+// then clear them if reset is set.
+void
+spin_dump(bool reset)
+{
+#ifdef DEBUG_SPINLOCK
+	struct {
+		const char *name;
+		uint32_t nlocks, acquires, contended;
+		uint64_t spin_cycles, max_hold;
+	} sum[32];
+	uint32_t tsc_per_us = time_tsc_per_ms() / 1000;
+	struct spinlock *lk;
+	int i, n = 0;
+
+	for (lk = spin_list; lk; lk = lk->stats_next) {
+		if (!lk->name)
+			continue;
+		for (i = 0; i < n; i++)
+			if (strcmp(sum[i].name, lk->name) == 0)
+				break;
+		if (i == n) {
+			if (n == ARRAY_SIZE(sum))
+				continue;
+			memset(&sum[n], 0, sizeof(sum[n]));
+			sum[n++].name = lk->name;
+		}
+		sum[i].nlocks++;
+		sum[i].acquires += lk->acquires;
+		sum[i].contended += lk->contended;
+		sum[i].spin_cycles += lk->spin_cycles;
+		if (lk->max_hold > sum[i].max_hold)
+			sum[i].max_hold = lk->max_hold;
+		if (reset) {
+			lk->acquires = lk->contended = 0;
+			lk->spin_cycles = lk->max_hold = 0;
+		}
+	}
+
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+	cprintf("LOCK            LOCKS   ACQUIRES  CONTENDED   AVG WAIT  MAX HOLD\n");
+	for (i = 0; i < n; i++)
+		cprintf("%-14s  %5u  %9u  %8u%%  %6ucyc  %6uus\n",
+			sum[i].name, sum[i].nlocks, sum[i].acquires,
+			sum[i].acquires ? (uint32_t) ((uint64_t) sum[i].contended *
+						      100 / sum[i].acquires) : 0,
+			sum[i].contended ? (uint32_t) (sum[i].spin_cycles /
+						       sum[i].contended) : 0,
+			(uint32_t) (sum[i].max_hold / tsc_per_us));
+#else
+	cprintf("Lock statistics need DEBUG_SPINLOCK\n");
+#endif
 }
@@ -13,6 +13,9 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -24,10 +27,20 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	user_mem_assert(curenv, s, len, 0);
+	// Hold the address space lock so that another thread of ours
+	// can't unmap the string between the check and the print.
+	spin_lock(&curenv->env_vm_lock);
+	if (user_mem_check(curenv, s, len, PTE_U) < 0) {
+		spin_unlock(&curenv->env_vm_lock);
+		// Doesn't return, unless another thread mapped the string
+		// meanwhile; we no longer hold the lock either way
+		user_mem_assert(curenv, s, len, 0);
+		return;
+	}
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	spin_unlock(&curenv->env_vm_lock);
 }
 
 // Read a character from the system console without blocking.
@@ -94,11 +107,70 @@ sys_exofork(void)
 	t = e->env_thd_head;
 	t->thd_tf = curthd->thd_tf; // 复制寄存器
 	t->thd_tf.tf_regs.reg_eax = 0; // 新的进程从sys_exofork()的返回值应该为0
+	t->thd_priority = curthd->thd_priority; // 子进程继承优先级
+	t->thd_affinity = curthd->thd_affinity;
 	e->env_status = ENV_NOT_RUNNABLE; // 进程状态
 	return e->env_id;
 	// panic("sys_exofork not implemented");
 }
 
+// Create a child environment that is a copy-on-write copy of the
+// current one (see pmap_fork) and set it running.  The child's only
+// thread starts as a copy of the calling thread, with sys_fork returning
+// 0, and gets the same page fault upcall and a fresh zeroed exception
+// stack at UXSTACKTOP - PGSIZE.
+//
+// This does in one trap what the library fork does with sys_exofork and
+// two sys_page_map calls per page.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	struct Thd *t;
+	struct PageInfo *pp;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	t = e->env_thd_head;
+	t->thd_tf = curthd->thd_tf;
+	t->thd_tf.tf_regs.reg_eax = 0;
+	t->thd_priority = curthd->thd_priority;
+	t->thd_affinity = curthd->thd_affinity;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_status = ENV_NOT_RUNNABLE;
+
+	if ((r = env_lock_vm(curenv, e)) < 0)
+		goto fail;
+	r = pmap_fork(curenv->env_pgdir, e->env_pgdir);
+	env_unlock_vm(curenv, e);
+	if (r < 0)
+		goto fail;
+
+	// Nobody else knows about e yet, so no need to lock it
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+		r = -E_NO_MEM;
+		goto fail;
+	}
+	if ((r = page_insert(e->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+			     PTE_P | PTE_U | PTE_W)) < 0) {
+		page_free(pp);
+		goto fail;
+	}
+
+	if ((r = env_set_status(e, ENV_RUNNABLE)) < 0)
+		goto fail;
+	return e->env_id;
+
+fail:
+	env_destroy(e);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -123,8 +195,8 @@ sys_env_set_status(envid_t envid, int status)
 	if(ret < 0){
 		return ret;
 	}
-	e->env_status = status;
-	return 0;
+	// 线程能否进入运行队列取决于进程状态
+	return env_set_status(e, status);
 	//panic("sys_env_set_status not implemented");
 }
 
@@ -186,12 +258,16 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be set too, to allocate a 4MB page: it replaces
+//         everything mapped in [va, va+PTSIZE).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned (4MB-aligned for
+//		PTE_PS).
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if va lies in a 4MB page and PTE_PS is not set.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 // 为特定进程分配一个物理页，映射指定线性地址va到该物理页。
@@ -213,21 +289,100 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	}
 	// 判定va合法性
 	if ((va >= (void*)UTOP) || PGOFF(va)) return -E_INVAL;
+	if ((perm & PTE_PS) && (uintptr_t) va % PTSIZE) return -E_INVAL;
 	// 判定权限
 	int flag = PTE_U | PTE_P;
-	if ((perm & ~(PTE_SYSCALL))!=0 || (perm & flag) != flag) return -E_INVAL;
+	if ((perm & ~(PTE_SYSCALL | PTE_PS))!=0 || (perm & flag) != flag) return -E_INVAL;
 	// 分配物理页
-	struct PageInfo * pp = page_alloc(1);
+	int order = (perm & PTE_PS) ? PAGE_LARGE_ORDER : 0;
+	struct PageInfo * pp = page_alloc_order(ALLOC_ZERO, order);
 	if(pp == NULL) return -E_NO_MEM;
+	if ((ret = env_lock_vm(e, e)) < 0) {
+		page_free_order(pp, order);
+		return ret;
+	}
 	ret = page_insert(e->env_pgdir, pp, va, perm);
+	env_unlock_vm(e, e);
 	if(ret < 0){ // page_insert错误
-		page_free(pp);
+		page_free_order(pp, order);
 		return ret;
 	}
 	return 0;
 	// panic("sys_page_alloc not implemented");
 }
 
+// Reserve the 'len' bytes at 'va' in envid's address space as demand-zero
+// memory with permission 'perm'.  Whatever is mapped there is unmapped.
+// No memory is allocated up front: reads see zeros, and a page gets a
+// zeroed page of its own the first time it is written to.  This is much
+// cheaper than sys_page_alloc for memory that may never be touched.
+//
+// perm -- as in sys_page_alloc, except that PTE_PS is not allowed.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or [va, va+len) is not below UTOP.
+//	-E_INVAL if perm is inappropriate.
+//	-E_INVAL if the range overlaps a 4MB page.
+//	-E_NO_MEM if there's no memory for the page tables.
+static int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (PGOFF(va) || (uintptr_t) va >= UTOP || len > UTOP - (uintptr_t) va)
+		return -E_INVAL;
+	if ((perm & ~PTE_SYSCALL) || (perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
+		return -E_INVAL;
+	if ((r = env_lock_vm(e, e)) < 0)
+		return r;
+	r = page_reserve(e->env_pgdir, va, ROUNDUP(len, PGSIZE), perm);
+	env_unlock_vm(e, e);
+	return r;
+}
+
+// The work of sys_page_map once both envs are looked up and their
+// address spaces locked.
+static int
+page_map_locked(struct Env *se, void *srcva, struct Env *de, void *dstva, int perm)
+{
+	int ret;
+
+	// 如果两个地址越界或者不是页对齐的，则返回错误
+	if (srcva >= (void*)UTOP || dstva >= (void*)UTOP || 
+		ROUNDDOWN(srcva,PGSIZE) != srcva || ROUNDDOWN(dstva,PGSIZE) != dstva) 
+		return -E_INVAL;
+
+	// 如果页权限不允许，则返回错误
+	int flag = PTE_U|PTE_P;
+	if ((perm & ~(PTE_SYSCALL | PTE_PS)) != 0 || (perm & flag) != flag) return -E_INVAL;
+	if ((perm & PTE_PS) && ((uintptr_t) srcva % PTSIZE || (uintptr_t) dstva % PTSIZE))
+		return -E_INVAL;
+
+	// 如果源页没有映射给源进程，则返回错误
+	pte_t *pte;
+	struct PageInfo *pg = page_lookup(se->env_pgdir, srcva, &pte);
+	// An untouched demand-zero page gets its memory now
+	if (pg == NULL && page_user_fault(se->env_pgdir, srcva, perm & PTE_W) == 0)
+		pg = page_lookup(se->env_pgdir, srcva, &pte);
+	if (pg == NULL)
+		ret = -E_INVAL;
+	// 如果权限为可写而源地址权限为只读，则返回错误
+	else if (((*pte&PTE_W) == 0) && (perm&PTE_W))
+		ret = -E_INVAL;
+	// 大页只能整体映射
+	else if ((*pte & PTE_PS) != (perm & PTE_PS))
+		ret = -E_INVAL;
+	// 如果内存不够生成页表也返回错误
+	else
+		ret = page_insert(de->env_pgdir, pg, dstva, perm);
+	return ret;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -243,6 +398,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva lies in a 4MB page but perm lacks PTE_PS, or the
+//		other way around.  A 4MB page can only be mapped whole, so
+//		srcva and dstva must then be 4MB-aligned.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 // 拷贝页表，使指定进程共享当前进程相同的映射关系。本质上是修改特定进程的页目录和页表。
 static int
@@ -263,31 +421,90 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	ret = envid2env(dstenvid, &de, 1);
 	if(ret) return ret; // 错误的Env
 
-	// 如果两个地址越界或者不是页对齐的，则返回错误
-	if (srcva >= (void*)UTOP || dstva >= (void*)UTOP || 
-		ROUNDDOWN(srcva,PGSIZE) != srcva || ROUNDDOWN(dstva,PGSIZE) != dstva) 
-		return -E_INVAL;
-
-	// 如果源页没有映射给源进程，则返回错误
-	pte_t *pte;
-	struct PageInfo *pg = page_lookup(se->env_pgdir, srcva, &pte);
-	if (pg == NULL) return -E_INVAL;
+	if ((ret = env_lock_vm(se, de)) < 0)
+		return ret;
+	ret = page_map_locked(se, srcva, de, dstva, perm);
+	env_unlock_vm(se, de);
+	return ret;
+	// panic("sys_page_map not implemented");
+}
 
-	// 如果页权限不允许，则返回错误
-	int flag = PTE_U|PTE_P;
-	if ((perm & ~(PTE_SYSCALL)) != 0 || (perm & flag) != flag) return -E_INVAL;
+// Carry out the n (at most PAGE_MAP_VEC_MAX) sys_page_map operations at
+// ops, in order, each from the caller's address space, and store each
+// one's result in its pm_status.  An operation that fails does not stop
+// the ones after it.
+//
+// This costs one trap instead of n.  Each destination env is looked up
+// once and stays locked, along with the caller, for as long as the
+// operations go to it or to the caller, and TLB shootdowns are batched.
+//
+// Returns the number of operations that failed, or < 0 on error:
+//	-E_INVAL if n is out of range.
+//	-E_FAULT if ops is not writable memory.
+static int
+sys_page_map_vec(struct PageMapOp *uops, int n)
+{
+	struct PageMapOp ops[PAGE_MAP_VEC_MAX], *op;
+	struct Env *de, *locked = NULL;
+	size_t size = n * sizeof(struct PageMapOp);
+	int i, r, nfail = 0;
 
-	// 如果权限为可写而源地址权限为只读，则返回错误
-	if (((*pte&PTE_W) == 0) && (perm&PTE_W)) return -E_INVAL;
+	if (n < 0 || n > PAGE_MAP_VEC_MAX)
+		return -E_INVAL;
+	spin_lock(&curenv->env_vm_lock);
+	if (user_mem_check(curenv, uops, size, PTE_U | PTE_W) < 0) {
+		spin_unlock(&curenv->env_vm_lock);
+		return -E_FAULT;
+	}
+	memcpy(ops, uops, size);
+	spin_unlock(&curenv->env_vm_lock);
+
+	for (i = 0; i < n; i++) {
+		op = &ops[i];
+		r = 0;
+		if (op->pm_dstenv == 0 || op->pm_dstenv == curenv->env_id)
+			de = curenv;
+		else if (locked && op->pm_dstenv == locked->env_id)
+			de = locked;
+		else
+			r = envid2env(op->pm_dstenv, &de, 1);
+
+		if (r == 0 && (!locked || (de != curenv && de != locked))) {
+			if (locked) {
+				tlb_batch_end();
+				env_unlock_vm(curenv, locked);
+				locked = NULL;
+			}
+			if ((r = env_lock_vm(curenv, de)) == 0) {
+				locked = de;
+				tlb_batch_begin();
+			}
+		}
+		if (r == 0)
+			r = page_map_locked(curenv, op->pm_srcva, de,
+					    op->pm_dstva, op->pm_perm);
+		if ((op->pm_status = r) < 0)
+			nfail++;
+	}
+	if (locked) {
+		tlb_batch_end();
+		env_unlock_vm(curenv, locked);
+	}
 
-	// 如果内存不够生成页表也返回错误
-	ret = page_insert(de->env_pgdir, pg, dstva, perm);
-	return ret;
-	// panic("sys_page_map not implemented");
+	spin_lock(&curenv->env_vm_lock);
+	if (user_mem_check(curenv, uops, size, PTE_U | PTE_W) < 0) {
+		spin_unlock(&curenv->env_vm_lock);
+		return -E_FAULT;
+	}
+	for (i = 0; i < n; i++)
+		uops[i].pm_status = ops[i].pm_status;
+	spin_unlock(&curenv->env_vm_lock);
+	return nfail;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// If va lies in a 4MB page, the whole 4MB page is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -305,29 +522,57 @@ sys_page_unmap(envid_t envid, void *va)
 	if (ret) return ret;
 
 	if ((va >= (void*)UTOP) || (ROUNDDOWN(va, PGSIZE) != va)) return -E_INVAL;
+	if ((ret = env_lock_vm(env, env)) < 0)
+		return ret;
 	page_remove(env->env_pgdir, va);
+	env_unlock_vm(env, env);
 	return 0;
 	// panic("sys_page_unmap not implemented");
 }
 
-// Try to send 'value' to the target env 'envid'.
+// Find the target of an IPC send: env 'envid', or if perm has IPC_THD,
+// the thread with thdid 'envid' and its env.  Stores the thread's id,
+// or 0 for any thread of the env, in *to_store, and clears IPC_THD.
+// Returns -E_BAD_ENV if there is no such env or thread.
+static int
+ipc_target(envid_t envid, unsigned *perm, struct Env **env_store,
+	   thdid_t *to_store)
+{
+	struct Thd *t;
+
+	*to_store = 0;
+	if (!(*perm & IPC_THD))
+		return envid2env(envid, env_store, 0) < 0 ? -E_BAD_ENV : 0;
+	*perm &= ~IPC_THD;
+	if (thdid2thd(envid, &t, 0) < 0)
+		return -E_BAD_ENV;
+	*env_store = t->thd_env;
+	*to_store = t->thd_id;
+	return 0;
+}
+
+// Try to send 'value' to the target env 'envid', or with IPC_THD in
+// perm, to the target thread 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If perm has IPC_WORDS, srcva instead points to IPC_NWORDS words to
+// send along with 'value', and no page is sent.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
-//
-// The send also can fail for the other reasons listed below.
+// If a thread of the target env that the message may go to is blocked
+// in sys_ipc_recv, the one that has waited longest gets it, and its ipc
+// fields are updated as follows:
+//    thd_ipc_recving is set to 0 to block future sends;
+//    thd_ipc_from and thd_ipc_from_thd are set to the sending envid
+//        and thdid;
+//    thd_ipc_value is set to the 'value' parameter, and thd_ipc_words
+//        to the words sent, or zeros;
+//    thd_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+// The thread is marked runnable again, returning 0 from the paused
+// sys_ipc_recv system call.
 //
-// Otherwise, the send succeeds, and the target's ipc fields are
-// updated as follows:
-//    env_ipc_recving is set to 0 to block future sends;
-//    env_ipc_from is set to the sending envid;
-//    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+// Otherwise the message, page included, waits in the target env's
+// mailbox (see kern/ipc.c) and the send succeeds too; the next
+// sys_ipc_recv by a thread it may go to returns it at once.
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -335,10 +580,9 @@ sys_page_unmap(envid_t envid, void *va)
 //
 // Returns 0 on success, < 0 on error.
 // Errors are:
-//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_BAD_ENV if environment or thread envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if the target's mailbox is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -346,51 +590,51 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if srcva lies in a 4MB page; only 4KB pages can be sent.
+//	-E_INVAL if perm has IPC_WORDS but the words at srcva can't be read.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//		address space, or for the target's mailbox.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_try_send not implemented");
 	struct Env* env;
-	if (envid2env(envid, &env, 0) < 0) return -E_BAD_ENV; // 错误ID
-	if (env->env_ipc_recving == 0) return -E_IPC_NOT_RECV; // 进程不接收消息
-	if ((uintptr_t) srcva < UTOP) { // 页地址小于UTOP
-		pte_t *pte;
-		struct PageInfo *pg = page_lookup(curenv->env_pgdir, srcva, &pte);
-
-		//按照注释的顺序进行判定
-		if (srcva != ROUNDDOWN(srcva, PGSIZE)) return -E_INVAL; //srcva没有页对齐
-		if ((*pte & perm & 7) != (perm & 7)) return -E_INVAL; //perm应该是*pte的子集
-		if (!pg) return -E_INVAL; //srcva还没有映射到物理页
-		if ((perm & PTE_W) && !(*pte & PTE_W)) return -E_INVAL; //写权限
-		
-		if (env->env_ipc_dstva < (void*)UTOP) {
-			int ret = page_insert(env->env_pgdir, pg, env->env_ipc_dstva, perm); //共享相同的映射关系
-			if (ret) return ret;
-			env->env_ipc_perm = perm;
-		}
-	}
-	// 设置一些值
-	env->env_ipc_recving = false;
-	env->env_ipc_from = curenv->env_id;
-	env->env_ipc_value = value;
-	// env->env_ipc_perm = 0;
-	env->env_ipc_thd->thd_status = THD_RUNNABLE;
-	env->env_ipc_thd->thd_tf.tf_regs.reg_eax = 0;
-	return 0;
+	thdid_t to;
+
+	if (ipc_target(envid, &perm, &env, &to) < 0) return -E_BAD_ENV; // 错误ID
+	return ipc_send(curthd, env, to, value, srcva, perm, 0, NULL);
+}
+
+// Like sys_ipc_try_send, but if the target's mailbox is full, wait
+// until there is room in it instead of failing with -E_IPC_NOT_RECV.
+// Fails with -E_BAD_ENV if the target goes away meanwhile.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *env;
+	thdid_t to;
+	int r;
+
+	if (ipc_target(envid, &perm, &env, &to) < 0)
+		return -E_BAD_ENV;
+	if ((r = ipc_send(curthd, env, to, value, srcva, perm, 1, NULL)) == 1)
+		sys_yield();
+	return r;
 }
 
 // Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
+// using the thd_ipc_recving and thd_ipc_dstva fields of struct Thd,
+// mark yourself not runnable, and then give up the CPU.  If a message
+// for this thread is already waiting in the mailbox, take it instead.
+// Other threads of the env may be receiving at the same time.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// This function only returns on error or with a queued message, but
+// the system call will eventually return 0 on success, with the value
+// received in edx and its words in ecx, ebx, edi and esi.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
 static int
@@ -399,11 +643,62 @@ sys_ipc_recv(void *dstva)
 	// LAB 4: Your code here.
 	// panic("sys_ipc_recv not implemented");
 	if ((dstva < (void*)UTOP) && PGOFF(dstva)) return -E_INVAL; // 报错
-	curenv->env_ipc_recving = true;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_ipc_thd = curthd;
-	curthd->thd_status = THD_NOT_RUNNABLE;
-	sys_yield();
+	if (ipc_recv(curthd, dstva) == 1)
+		sys_yield();
+	return 0;
+}
+
+// Send to envid as sys_ipc_try_send does, then receive into dstva as
+// sys_ipc_recv does, typically the reply.  If the message goes to a
+// thread waiting in sys_ipc_recv or sys_ipc_reply_wait, this CPU runs
+// that thread next.  Fails, without receiving anything, if the send
+// fails; -E_IPC_NOT_RECV means envid's mailbox is full.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *env;
+	struct Thd *next;
+	thdid_t to;
+	int r;
+
+	if (ipc_target(envid, &perm, &env, &to) < 0)
+		return -E_BAD_ENV;
+	if ((dstva < (void*)UTOP) && PGOFF(dstva))
+		return -E_INVAL;
+	if ((r = ipc_call(curthd, env, to, value, srcva, perm, dstva,
+			  &next)) == 1) {
+		if (next)
+			sched_handoff(next);
+		sys_yield();
+	}
+	return r;
+}
+
+// For servers: reply to envid, unless it is 0, as sys_ipc_try_send
+// does, then receive the next request into dstva as sys_ipc_recv does.
+// A reply that can't be sent is dropped.  Hands the CPU to the client
+// as sys_ipc_call does.
+// Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+	struct Env *env = NULL;
+	struct Thd *next;
+	thdid_t to = 0;
+
+	if ((dstva < (void*)UTOP) && PGOFF(dstva))
+		return -E_INVAL;
+	if (envid && ipc_target(envid, &perm, &env, &to) < 0)
+		env = NULL;
+	if (ipc_reply_wait(curthd, env, to, value, srcva, perm, dstva,
+			   &next) == 1) {
+		if (next)
+			sched_handoff(next);
+		sys_yield();
+	}
 	return 0;
 }
 
@@ -436,7 +731,7 @@ static thdid_t sys_thd_create() {
 	r = thd_alloc(&t,curenv);
 	if(r < 0) 
 		return r;
-	t->thd_status = THD_NOT_RUNNABLE;
+	sched_block(t);
 	return t->thd_id;
 }
 
@@ -456,7 +751,17 @@ static int sys_thd_set_status(thdid_t tid, int status) {
 	if (r < 0) return r;
 	if (status != THD_RUNNABLE && status != THD_NOT_RUNNABLE)
 		return -E_INVAL;
-	t->thd_status  = status;
+	// A running or dying thread is already taken care of.  A thread
+	// blocked on a futex or in IPC must come off it, or a later
+	// futex_wake or send would pick it up while it runs and clobber
+	// its registers.
+	if (status == THD_RUNNABLE) {
+		sched_cancel_sleep(t);
+		futex_cancel(t);
+		ipc_abort(t);
+		sched_wakeup(t);
+	} else
+		sched_block(t);
 	return 0;
 }
 static int sys_thd_set_trapframe(thdid_t tid, struct Trapframe *tf) {
@@ -464,13 +769,22 @@ static int sys_thd_set_trapframe(thdid_t tid, struct Trapframe *tf) {
 	int r;
 	r = thdid2thd(tid, &t, true);
 	if (r < 0) return r;
-	user_mem_assert(curenv, tf, sizeof(struct Trapframe), 0);
+	spin_lock(&curenv->env_vm_lock);
+	if (user_mem_check(curenv, tf, sizeof(struct Trapframe), PTE_U) < 0) {
+		spin_unlock(&curenv->env_vm_lock);
+		return -E_FAULT;
+	}
 	t->thd_tf = *tf;
+	spin_unlock(&curenv->env_vm_lock);
 	t->thd_tf.tf_ds = GD_UD | 3;
 	t->thd_tf.tf_es = GD_UD | 3;
 	t->thd_tf.tf_ss = GD_UD | 3;
 	t->thd_tf.tf_cs = GD_UT | 3;
     t->thd_tf.tf_eflags |= FL_IF;
+	// Only the file system's threads may do I/O, as env_create says
+	t->thd_tf.tf_eflags &= ~FL_IOPL_MASK;
+	if (curenv->env_type == ENV_TYPE_FS)
+		t->thd_tf.tf_eflags |= FL_IOPL_MASK;
 	return 0;
 }
 
@@ -484,6 +798,85 @@ static int sys_thd_set_uxstack(thdid_t tid, uintptr_t uxstack) {
 	return 0;
 }
 
+// Restrict thread 'tid' of the current env to the CPUs in 'cpumask'
+// (bit i for CPU i).  Bits for CPUs that don't exist are ignored.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if tid doesn't exist or belongs to another env.
+//	-E_INVAL if cpumask names no existing CPU.
+static int sys_thd_set_affinity(thdid_t tid, uint32_t cpumask) {
+	struct Thd * t;
+	int r;
+	r = thdid2thd(tid, &t, true);
+	if (r < 0) return r;
+	if (ncpu < 32)
+		cpumask &= (1u << ncpu) - 1;
+	if (cpumask == 0)
+		return -E_INVAL;
+	sched_set_affinity(t, cpumask);
+	return 0;
+}
+
+// Block the current thread for at least msec milliseconds.
+// Returns 0 once it has slept; never fails.
+static int sys_thd_sleep(uint32_t msec) {
+	// sched_yield doesn't return here, so set the result up front
+	curthd->thd_tf.tf_regs.reg_eax = 0;
+	if (msec > 0)
+		sched_sleep(curthd, msec, 0);
+	sys_yield();
+	return 0;
+}
+
+// Set the scheduling priority of thread 'tid' in the current env.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if tid doesn't exist or belongs to another env.
+//	-E_INVAL if prio is outside THD_PRIO_MIN..THD_PRIO_MAX.
+static int sys_thd_set_priority(thdid_t tid, int prio) {
+	struct Thd * t;
+	int r;
+	r = thdid2thd(tid, &t, true);
+	if (r < 0) return r;
+	if (prio < THD_PRIO_MIN || prio > THD_PRIO_MAX)
+		return -E_INVAL;
+	sched_set_priority(t, prio);
+	return 0;
+}
+
+// Block the current thread until another thread calls sys_futex_wake on
+// addr, or until timeout milliseconds have passed if timeout is not 0.
+// addr may be in any page the env can read, including ones shared with
+// other envs and the read-only UTHDS.
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_AGAIN if *addr != val to begin with.
+//	-E_TIMEOUT if the timeout ran out.
+//	-E_INVAL if addr is not aligned or not mapped.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, uint32_t timeout)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(curenv, addr, &key)) < 0 ||
+	    (r = futex_wait(curthd, key, val, timeout)) < 0)
+		return r;
+	sys_yield();
+	return 0;
+}
+
+// Wake up to n threads blocked in sys_futex_wait on addr.
+// Returns the number woken, or -E_INVAL if addr is not aligned or not
+// mapped.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(curenv, addr, &key)) < 0)
+		return r;
+	return futex_wake(key, n);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -562,6 +955,39 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_thd_set_uxstack:
 			ret = sys_thd_set_uxstack((thdid_t) a1, a2);
 			break;
+		case SYS_thd_set_affinity:
+			ret = sys_thd_set_affinity((thdid_t) a1, a2);
+			break;
+		case SYS_thd_sleep:
+			ret = sys_thd_sleep(a1);
+			break;
+		case SYS_thd_set_priority:
+			ret = sys_thd_set_priority((thdid_t) a1, (int) a2);
+			break;
+		case SYS_futex_wait:
+			ret = sys_futex_wait((uint32_t *) a1, a2, a3);
+			break;
+		case SYS_futex_wake:
+			ret = sys_futex_wake((uint32_t *) a1, (int) a2);
+			break;
+		case SYS_fork:
+			ret = sys_fork();
+			break;
+		case SYS_page_reserve:
+			ret = sys_page_reserve(a1, (void *) a2, a3, a4);
+			break;
+		case SYS_page_map_vec:
+			ret = sys_page_map_vec((struct PageMapOp *) a1, a2);
+			break;
+		case SYS_ipc_send:
+			ret = sys_ipc_send((envid_t) a1, a2, (void *) a3, a4);
+			break;
+		case SYS_ipc_call:
+			ret = sys_ipc_call((envid_t) a1, a2, (void *) a3, a4, (void *) a5);
+			break;
+		case SYS_ipc_reply_wait:
+			ret = sys_ipc_reply_wait((envid_t) a1, a2, (void *) a3, a4, (void *) a5);
+			break;
 		default:
 			ret = -E_INVAL;
 	}
@@ -1,26 +1,59 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
+#include <inc/x86.h>
 #include <inc/assert.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, which counts at a constant rate whether or
+// not any CPU is taking timer interrupts.  Its rate is measured once at
+// boot against channel 2 of the 8253 PIT, whose input clock is fixed.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42		// Channel 2 data port
+#define PIT_MODE	0x43		// Mode/command register
+#define PIT_GATE	0x61		// Channel 2 gate (bit 0) and output (bit 5)
+#define CALIBRATE_MS	10
+
+static uint64_t tsc_boot;
+static uint32_t tsc_per_ms;
+
+// Count TSC cycles during CALIBRATE_MS of PIT time.
+static uint32_t
+pit_calibrate_tsc(void)
+{
+	uint32_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+	uint64_t t0, t1;
+
+	// Enable the channel 2 gate, keep the speaker off
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	// Channel 2, lobyte/hibyte, mode 0: output goes high at zero
+	outb(PIT_MODE, 0xb0);
+	outb(PIT_CH2, latch & 0xff);
+	outb(PIT_CH2, latch >> 8);
+
+	t0 = read_tsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	t1 = read_tsc();
+	return (t1 - t0) / CALIBRATE_MS;
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	tsc_per_ms = pit_calibrate_tsc();
+	if (tsc_per_ms == 0)
+		panic("time_init: TSC does not tick");
+	tsc_boot = read_tsc();
+	lapic_timer_calibrate(tsc_per_ms);
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+uint32_t
+time_tsc_per_ms(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return tsc_per_ms;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return (read_tsc() - tsc_boot) / tsc_per_ms;
 }
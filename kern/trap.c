@@ -293,20 +293,27 @@ trap_dispatch(struct Trapframe *tf)
 	// interrupt using lapic_eoi() before calling the scheduler!
 	// LAB 4: Your code here.
 	// 时钟中断
+	// The timer is one-shot; the scheduler re-arms it as needed.
+	// Time itself is kept by the TSC (see kern/time.c).
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		if (cpunum() == 0) { //lab6
-			time_tick();
-		}
 		sched_yield();
 		return;
 	}
 
-	// Add time tick increment to clock interrupts.
-	// Be careful! In multiprocessors, clock interrupts are
-	// triggered on every CPU.
-	// LAB 6: Your code here.
-	// 直接修改Lab4代码
+	// Another CPU changed page tables that we have loaded.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		tlb_shootdown_handler();
+		return;
+	}
+
+	// Another CPU queued work that we should run or steal.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		sched_yield();
+		return;
+	}
 
 
 	// Handle keyboard and serial interrupts.
@@ -345,10 +352,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We may have been halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -356,18 +361,16 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
+		// There is no big kernel lock; each subsystem takes its
+		// own lock (see kern/sched.c and kern/env.c).
 		assert(curthd);
 
 		// Garbage collect if current enviroment is a zombie
 		if (curthd->thd_status == THD_DYING) {
-			thd_free(curthd);
-			if (curenv->env_thd_head == NULL) {
-				env_free(curenv);
-			}
+			struct Env *e = curenv;
+
+			if (thd_free(curthd))
+				env_free(e);
 			curthd = NULL;
 			sched_yield();
 		}
@@ -401,6 +404,7 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -428,6 +432,17 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Resolve copy-on-write and demand-zero faults right here rather
+	// than through the upcall.  If we can't (out of memory, say), the
+	// upcall gets them.
+	if (env_lock_vm(curenv, curenv) == 0) {
+		r = page_user_fault(curenv->env_pgdir, (void *) fault_va,
+				    tf->tf_err & FEC_WR);
+		env_unlock_vm(curenv, curenv);
+		if (r == 0)
+			return;
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -470,13 +485,23 @@ page_fault_handler(struct Trapframe *tf)
 			utr = (struct UTrapframe *)(curthd->thd_uxstack - sizeof(struct UTrapframe));	
 		}
 		// 检查异常栈是否溢出
-		user_mem_assert(curenv, (const void *) utr, sizeof(struct UTrapframe), PTE_P|PTE_W);
+		// Another thread of this env may be unmapping the exception
+		// stack, so check and write it under the address space lock.
+		spin_lock(&curenv->env_vm_lock);
+		if (user_mem_check(curenv, (const void *) utr, sizeof(struct UTrapframe), PTE_P|PTE_W|PTE_U) < 0) {
+			spin_unlock(&curenv->env_vm_lock);
+			// If another thread mapped the stack meanwhile, this
+			// returns, and the fault happens again
+			user_mem_assert(curenv, (const void *) utr, sizeof(struct UTrapframe), PTE_P|PTE_W);
+			return;
+		}
 		utr->utf_fault_va = fault_va;
 		utr->utf_err = tf->tf_trapno;
 		utr->utf_regs = tf->tf_regs;
 		utr->utf_eip = tf->tf_eip;
 		utr->utf_eflags = tf->tf_eflags;
 		utr->utf_esp = tf->tf_esp; // UXSTACKTOP栈上需要保存发生缺页异常时的%esp和%eip
+		spin_unlock(&curenv->env_vm_lock);
 		// 设置eip，回到用户态
 		curthd->thd_tf.tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
 		curthd->thd_tf.tf_esp = (uintptr_t)utr;
@@ -6,6 +6,8 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +17,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -24,8 +25,31 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Send a small request, whose body is the 'n' bytes at 'req', to the
+// file server in registers, without mapping fsipcbuf.  The server sends
+// back the first IPC_NWORDS words of what the request leaves in its
+// union Fsipc, which are stored in 'words', if nonnull.
+// Returns result from the file server.
+static int
+fsipc_small(unsigned type, const void *req, size_t n, uint32_t *words)
+{
+	uint32_t buf[IPC_NWORDS];
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	assert(n <= sizeof(buf));
+	memset(buf, 0, sizeof(buf));
+	memmove(buf, req, n);
+
+	if (debug)
+		cprintf("[%08x] fsipc_small %d %08x\n", thisenv->env_id, type, buf[0]);
+
+	return ipc_callw(fsenv, type, buf, words);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -99,8 +123,11 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Fsreq_flush req = { fd->fd_file.id };
+
+	if (fsring_active())
+		return fsring_call(FSREQ_FLUSH, &req, sizeof(req), NULL, 0);
+	return fsipc_small(FSREQ_FLUSH, &req, sizeof(req), NULL);
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -117,6 +144,26 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	// A read that fits in a ring slot or in registers needs no page
+	if (fsring_active() && n <= FSSLOT_BODY) {
+		struct Fsreq_read req = { fd->fd_file.id, n };
+
+		if ((r = fsring_call(FSREQ_READ, &req, sizeof(req), buf, n)) < 0)
+			return r;
+		assert(r <= n);
+		return r;
+	}
+	if (n <= IPC_NWORDS * sizeof(uint32_t)) {
+		struct Fsreq_read req = { fd->fd_file.id, n };
+		uint32_t words[IPC_NWORDS];
+
+		if ((r = fsipc_small(FSREQ_READ, &req, sizeof(req), words)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, words, r);
+		return r;
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -142,6 +189,20 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	// panic("devfile_write not implemented");
+	if (fsring_active() &&
+	    n <= FSSLOT_BODY - offsetof(struct Fsreq_write, req_buf)) {
+		struct Fsreq_write *req;
+		char body[FSSLOT_BODY] __attribute__((aligned(sizeof(uint32_t))));
+
+		req = (struct Fsreq_write *) body;
+		req->req_fileid = fd->fd_file.id;
+		req->req_n = n;
+		memmove(req->req_buf, buf, n);
+		return fsring_call(FSREQ_WRITE, body,
+				   offsetof(struct Fsreq_write, req_buf) + n,
+				   NULL, 0);
+	}
+
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
@@ -151,14 +212,25 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
+	struct Fsret_stat *ret = &fsipcbuf.statRet;
+	struct Fsret_stat ringret;
 	int r;
 
-	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
-		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	if (fsring_active()) {
+		struct Fsreq_stat req = { fd->fd_file.id };
+
+		if ((r = fsring_call(FSREQ_STAT, &req, sizeof(req),
+				     &ringret, sizeof(ringret))) < 0)
+			return r;
+		ret = &ringret;
+	} else {
+		fsipcbuf.stat.req_fileid = fd->fd_file.id;
+		if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+			return r;
+	}
+	strcpy(st->st_name, ret->ret_name);
+	st->st_size = ret->ret_size;
+	st->st_isdir = ret->ret_isdir;
 	return 0;
 }
 
@@ -166,9 +238,11 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	struct Fsreq_set_size req = { fd->fd_file.id, newsize };
+
+	if (fsring_active())
+		return fsring_call(FSREQ_SET_SIZE, &req, sizeof(req), NULL, 0);
+	return fsipc_small(FSREQ_SET_SIZE, &req, sizeof(req), NULL);
 }
 
 
@@ -179,6 +253,8 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	if (fsring_active())
+		return fsring_call(FSREQ_SYNC, NULL, 0, NULL, 0);
+	return fsipc_small(FSREQ_SYNC, NULL, 0, NULL);
 }
 
@@ -3,13 +3,11 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// The kernel normally resolves copy-on-write faults itself (see
+// page_user_fault), so this only runs when it could not.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -26,7 +24,7 @@ pgfault(struct UTrapframe *utf)
 
 	// LAB 4: Your code here.
 	if (!(
-        (err & FEC_WR) && (uvpd[PDX(addr)] & PTE_P) &&
+        (err & FEC_WR) && (uvpd[PDX(addr)] & PTE_P) && !(uvpd[PDX(addr)] & PTE_PS) &&
         (uvpt[PGNUM(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_COW)
 	)) panic("Neither the fault is a write nor copy-on-write page.\n");//如果不是因为这个原因 就panic
 
@@ -57,11 +55,13 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued up on v; the caller flushes it.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct PageMapVec *v, envid_t envid, unsigned pn)
 {
 	int r;
 
@@ -71,24 +71,29 @@ duppage(envid_t envid, unsigned pn)
 	if (!(uvpd[PDX(pn)] & PTE_P))
 		return 0;
 	int perm = 0xfff & uvpt[PGNUM(pn)];
-	if (!(perm & PTE_P))
+	if (!(perm & PTE_P)) {
+		// An untouched demand-zero page stays one in the child
+		if ((perm & PTE_ANON) &&
+		    (r = sys_page_reserve(envid, vaddr, PGSIZE, (perm & PTE_SYSCALL) | PTE_P)) < 0)
+			panic("At duppage: %e", r);
 		return 0;
+	}
 	if (perm & PTE_SHARE) {
 		// Lab5: 对于标识为PTE_SHARE的页，拷贝映射关系，并且两个进程都有读写权限
-		if((r = sys_page_map(0, vaddr, envid, vaddr, PTE_SYSCALL)) < 0)
+		if((r = pagemap_add(v, vaddr, envid, vaddr, perm & PTE_SYSCALL)) < 0)
 			panic("At duppage 0: %e", r);
 	}
 	else if ((perm & PTE_U) && ((perm & PTE_W) || (perm & PTE_COW))) {
 		// 映射当前页为写时复制
-		if ((r = sys_page_map(0, vaddr, envid, vaddr, PTE_COW | PTE_U | PTE_P)) < 0)
+		if ((r = pagemap_add(v, vaddr, envid, vaddr, PTE_COW | PTE_U | PTE_P)) < 0)
 			panic("At duppage 1: %e", r);
 		// 把自己当前页页标记成写时复制
-		if ((r = sys_page_map(0, vaddr, 0, vaddr, PTE_COW | PTE_P | PTE_U)) < 0)
+		if ((r = pagemap_add(v, vaddr, 0, vaddr, PTE_COW | PTE_P | PTE_U)) < 0)
 			panic("At duppage 2: %e", r);
 	}
 	else {
 		// 如果当前页已经是写时复制  就不需要更改了
-		if ((r = sys_page_map(0, vaddr, envid, vaddr, perm)) < 0)
+		if ((r = pagemap_add(v, vaddr, envid, vaddr, perm & PTE_SYSCALL)) < 0)
 			panic("At duppage 3: %e", r);
 	}
 	//panic("duppage not implemented");
@@ -96,7 +101,36 @@ duppage(envid_t envid, unsigned pn)
 }
 
 //
-// User-level fork with copy-on-write.
+// Give the child the 4MB page at va: the same page if it is shared,
+// otherwise a copy.  There is no copy-on-write for 4MB pages, so this
+// copies all of it right away, through a temporary mapping at UTEMP.
+//
+static void
+duplarge(envid_t envid, uintptr_t va)
+{
+	int perm = uvpd[PDX(va)] & (PTE_SYSCALL | PTE_PS);
+	int r;
+
+	if (perm & PTE_SHARE) {
+		if ((r = sys_page_map(0, (void *) va, envid, (void *) va, perm)) < 0)
+			panic("duplarge: %e", r);
+		return;
+	}
+	if ((r = sys_page_alloc(envid, (void *) va, perm | PTE_W)) < 0)
+		panic("duplarge: %e", r);
+	if ((r = sys_page_map(envid, (void *) va, 0, UTEMP, PTE_P | PTE_U | PTE_W | PTE_PS)) < 0)
+		panic("duplarge: %e", r);
+	memmove(UTEMP, (void *) va, PTSIZE);
+	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+		panic("duplarge: %e", r);
+	if (!(perm & PTE_W) &&
+	    (r = sys_page_map(envid, (void *) va, envid, (void *) va, perm)) < 0)
+		panic("duplarge: %e", r);
+}
+
+//
+// User-level fork with copy-on-write.  fork does the same in the
+// kernel; this stays for comparison (see user/forktree).
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -112,21 +146,34 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	envid_t cenvid;
     unsigned pn;
     int r;
+	struct PageMapVec v;
 	set_pgfault_handler(pgfault); //设置 缺页处理
 	if ((cenvid = sys_exofork()) < 0){ //创建了一个进程。
 		panic("sys_exofork failed");
 		return cenvid;
 	}
 	if(cenvid>0){//如果是 父亲进程
+		// 4MB pages first: copying them uses UTEMP, which must not
+		// be in the way of a copy-on-write fault on our own stack.
+		for(int i = 0; i < UTOP; i += PTSIZE)
+			if ((uvpd[PDX(i)] & PTE_P) && (uvpd[PDX(i)] & PTE_PS))
+				duplarge(cenvid, i);
+		// The pages go over PAGE_MAP_VEC_MAX mappings at a time
+		pagemap_init(&v);
 		for(int i = 0; i < UTOP; i += PGSIZE)
-			if (i != UXSTACKTOP - PGSIZE)
-				duppage(cenvid, PGNUM(i));
+			// 4MB pages are done; empty page tables have nothing
+			if (!(uvpd[PDX(i)] & PTE_P) || (uvpd[PDX(i)] & PTE_PS))
+				i += PTSIZE - PGSIZE;
+			else if (i != UXSTACKTOP - PGSIZE)
+				duppage(&v, cenvid, PGNUM(i));
+		if ((r = pagemap_flush(&v)) < 0)
+			panic("lib/fork.c fork(): %e", r);
 		if ((r = sys_page_alloc(cenvid, (void *)(UXSTACKTOP-PGSIZE), PTE_U | PTE_P | PTE_W)) < 0) {  //分配一个新的页
             panic("lib/fork.c fork(): error when alloc page!\n");
 			return r;
@@ -149,6 +196,25 @@ fork(void)
 	//panic("fork not implemented");
 }
 
+//
+// Fork with copy-on-write, copying the address space in the kernel
+// (sys_fork) rather than page by page from here.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	// The page fault handler resolves the copy-on-write faults, in
+	// the parent as well as in the child, which inherits it.
+	set_pgfault_handler(pgfault);
+	if ((envid = sys_fork()) == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
+
 // Challenge!
 int
 sfork(void)
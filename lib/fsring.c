@@ -0,0 +1,134 @@
+// Request rings: an optional channel to the file server for small
+// requests.  fsring_open shares a page of request slots with the server
+// once, and from then on a request is posted in a free slot and the
+// server told by bumping the ring's doorbell; neither side maps a page
+// or makes an IPC for it.  The server's ring thread sleeps on the
+// doorbell only once it has found nothing to do, and the client sleeps
+// only while its reply isn't there yet or every slot is taken, so futex
+// wakes are needed only when one side has gone to sleep.
+//
+// Slots are handed out with compare-and-swap, so the threads of an env,
+// and the envs it forks, which share the ring, can all keep requests
+// outstanding at once.  The file functions use the ring on their own
+// once it is open, for requests whose body and reply fit in a slot.
+
+#include <inc/fs.h>
+#include <inc/lib.h>
+
+// The ring lives at FSRINGVA, not in our own data: fork hands PTE_SHARE
+// pages on at the same address, and spawn, which would put it where the
+// new program keeps something else, leaves it out.
+static struct Fsring *const ring = (struct Fsring *) FSRINGVA;
+static bool fsring_on;
+
+// Set up the request ring, if it isn't already.
+// Returns 0 on success, < 0 on error.
+int
+fsring_open(void)
+{
+	static envid_t fsenv;
+	int r;
+
+	static_assert(sizeof(struct Fsring) == PGSIZE);
+	if (fsring_on)
+		return 0;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	// A fresh page, shared with the children we fork
+	if ((r = sys_page_alloc(0, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	if ((r = ipc_call(fsenv, FSREQ_RING, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE,
+			  NULL, NULL)) < 0) {
+		sys_page_unmap(0, ring);
+		return r;
+	}
+	fsring_on = 1;
+	return 0;
+}
+
+// Is the request ring open?
+bool
+fsring_active(void)
+{
+	return fsring_on;
+}
+
+// Post a request of the given type, whose body is the 'n' bytes at 'req',
+// in a free slot of the ring, waiting for one if need be.
+// Returns the slot, to pass to fsring_wait.
+int
+fsring_submit(unsigned type, const void *req, size_t n)
+{
+	struct Fsslot *slot;
+	uint32_t free;
+	int i;
+
+	assert(fsring_on && n <= FSSLOT_BODY);
+	while (1) {
+		free = ring->fr_free;
+		for (i = 0; i < FSRING_NSLOT; i++)
+			if (ring->fr_slots[i].fs_state == FSSLOT_FREE &&
+			    __sync_bool_compare_and_swap(&ring->fr_slots[i].fs_state,
+							 FSSLOT_FREE, FSSLOT_FILL))
+				break;
+		if (i < FSRING_NSLOT)
+			break;
+		// All taken by requests in flight: sleep until one is
+		// freed, unless one just has been
+		if ((free & 1) ||
+		    __sync_bool_compare_and_swap(&ring->fr_free, free, free | 1))
+			sys_futex_wait(&ring->fr_free, free | 1, 0);
+	}
+
+	slot = &ring->fr_slots[i];
+	slot->fs_type = type;
+	memmove(slot->fs_body, req, n);
+	// The server must see the request before the slot posted
+	__sync_synchronize();
+	slot->fs_state = FSSLOT_REQ;
+	if (__sync_fetch_and_add(&ring->fr_doorbell, 2) & 1)
+		sys_futex_wake(&ring->fr_doorbell, 1);
+	return i;
+}
+
+// Wait for the reply to the request posted in slot i, copy the first 'n'
+// bytes of it to 'ret', if nonnull, and free the slot.
+// Returns the result from the file server.
+int
+fsring_wait(int i, void *ret, size_t n)
+{
+	struct Fsslot *slot = &ring->fr_slots[i];
+	uint32_t s;
+	int r;
+
+	assert(n <= FSSLOT_BODY);
+	while ((s = slot->fs_state) != FSSLOT_DONE) {
+		if (!(s & FSSLOT_WAIT) &&
+		    !__sync_bool_compare_and_swap(&slot->fs_state, s, s | FSSLOT_WAIT))
+			continue;
+		sys_futex_wait(&slot->fs_state, s | FSSLOT_WAIT, 0);
+	}
+
+	// Read the reply only after seeing it done, and all of it before
+	// the slot can be taken again
+	__sync_synchronize();
+	if (ret)
+		memmove(ret, slot->fs_body, n);
+	r = slot->fs_ret;
+	__sync_synchronize();
+	slot->fs_state = FSSLOT_FREE;
+	if (__sync_fetch_and_add(&ring->fr_free, 2) & 1) {
+		__sync_fetch_and_and(&ring->fr_free, ~1);
+		sys_futex_wake(&ring->fr_free, NTHD);
+	}
+	return r;
+}
+
+// Make a request through the ring and wait for its reply, as
+// fsring_submit and fsring_wait do.
+int
+fsring_call(unsigned type, const void *req, size_t n, void *ret, size_t retn)
+{
+	return fsring_wait(fsring_submit(type, req, n), ret, retn);
+}
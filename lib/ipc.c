@@ -15,7 +15,8 @@
 // Otherwise, return the value sent by the sender
 //
 // Hint:
-//   Use 'thisenv' to discover the value and who sent it.
+//   sys_ipc_recv returns the value in a register; use 'thisthd' to
+//   discover who sent it: every thread receives its own messages.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value, since that's
 //   a perfectly valid place to map a page.)
@@ -24,46 +25,152 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
 	// LAB 4: Your code here.
 	// panic("ipc_recv not implemented");
-	if (pg == NULL) pg = (void*)-1;
-	int r = sys_ipc_recv(pg);
+	return ipc_recvw(from_env_store, pg, perm_store, NULL);
+}
+
+// Store the sender and page permission of the message this thread just
+// received, as ipc_recv does.  Only these need a look at thisthd.
+static void
+ipc_stores(int r, envid_t *from_env_store, int *perm_store)
+{
+	const volatile struct Thd *t;
+
 	if (r < 0) { // UTOP相当于没有地址返回0
 		if (from_env_store != NULL) *from_env_store = 0;
 		if (perm_store != NULL) *perm_store = 0;
-		return r;
+		return;
 	}
-	if (from_env_store != NULL) *from_env_store = thisenv->env_ipc_from;
-	if (perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
-	return thisenv->env_ipc_value;
+	if (from_env_store == NULL && perm_store == NULL)
+		return;
+	t = thisthd;
+	if (from_env_store != NULL) *from_env_store = t->thd_ipc_from;
+	if (perm_store != NULL) *perm_store = t->thd_ipc_perm;
+}
+
+// Receive as ipc_recv does, and if 'words_store' is nonnull, store the
+// IPC_NWORDS words that came with the value there.  The words are zero
+// unless the sender sent some with IPC_WORDS.
+int32_t
+ipc_recvw(envid_t *from_env_store, void *pg, int *perm_store,
+	  uint32_t *words_store)
+{
+	uint32_t value;
+	int r;
+
+	if (pg == NULL) pg = (void*)-1;
+	r = sys_ipc_recv(pg, &value, words_store);
+	ipc_stores(r, from_env_store, perm_store);
+	return r < 0 ? r : value;
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// The kernel queues the message if 'toenv' isn't receiving yet, and
+// blocks us only while its mailbox is full.  Panics on any error.
+// With IPC_THD in 'perm', 'toenv' is a thdid and only that thread
+// receives the message.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
 	// panic("ipc_send not implemented");
-	static spinlock_t ipc_lock = 0;
+	int r;
+
 	if (pg == NULL) pg = (void*)-1;
-	spin_lock(&ipc_lock);
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
+		panic("ipc_send():%e", r);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for the reply, which is returned as ipc_recv returns it.  Any
+// page in the reply is mapped at 'rcv_pg', if nonnull.  The kernel runs
+// the receiving server thread right away if one is waiting.
+// Panics if the send fails.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	uint32_t value;
 	int r;
-	while(1) {
-		r = sys_ipc_try_send(to_env, val, pg, perm);
-		if (r == 0) { //发送成功
-			break;
-		} else if (r == -E_IPC_NOT_RECV) { //接收进程没有准备好
-			sys_yield();
-		} else { //其它错误
-			panic("ipc_send():%e", r);
-		}
+
+	if (pg == NULL) pg = (void*)-1;
+	if (rcv_pg == NULL) rcv_pg = (void*)-1;
+	r = sys_ipc_call(to_env, val, pg, perm, rcv_pg, &value, NULL);
+	if (r == -E_IPC_NOT_RECV) {
+		// Its mailbox is full; wait for room
+		ipc_send(to_env, val, pg, perm);
+		return ipc_recv(NULL, rcv_pg, perm_store);
+	}
+	if (r < 0)
+		panic("ipc_call():%e", r);
+	ipc_stores(r, NULL, perm_store);
+	return value;
+}
+
+// Call 'to_env' as ipc_call does, but with the IPC_NWORDS words at
+// 'words', if nonnull, in place of a page, and store the words of the
+// reply in 'words_store', if nonnull.  Neither side maps a page, so
+// small requests should use this.
+int32_t
+ipc_callw(envid_t to_env, uint32_t val, const uint32_t *words,
+	  uint32_t *words_store)
+{
+	void *pg = words ? (void *) words : (void*)-1;
+	int perm = words ? IPC_WORDS : 0;
+	uint32_t value;
+	int r;
+
+	r = sys_ipc_call(to_env, val, pg, perm, (void*)-1, &value, words_store);
+	if (r == -E_IPC_NOT_RECV) {
+		// Its mailbox is full; wait for room
+		if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
+			panic("ipc_callw():%e", r);
+		return ipc_recvw(NULL, NULL, NULL, words_store);
+	}
+	if (r < 0)
+		panic("ipc_callw():%e", r);
+	return value;
+}
+
+// For servers: reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull)
+// to 'to_env', unless it is 0, and then receive the next request as
+// ipc_recv does.  A reply that can't be delivered is dropped.  A server
+// thread normally replies to the client thread that asked, which is
+// thisthd->thd_ipc_from_thd after the request, with IPC_THD in 'perm'.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	uint32_t value;
+	int r;
+
+	if (pg == NULL) pg = (void*)-1;
+	if (rcv_pg == NULL) rcv_pg = (void*)-1;
+	r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg, &value, NULL);
+	ipc_stores(r, from_env_store, perm_store);
+	return r < 0 ? r : value;
+}
+
+// Like ipc_reply_wait, but reply with the IPC_NWORDS words at 'words',
+// if nonnull, in place of a page, and store the words of the next
+// request in 'words_store', if nonnull.
+int32_t
+ipc_reply_waitw(envid_t to_env, uint32_t val, const uint32_t *words,
+		int perm, envid_t *from_env_store, void *rcv_pg,
+		int *perm_store, uint32_t *words_store)
+{
+	void *pg = (void*)-1;
+	uint32_t value;
+	int r;
+
+	if (words != NULL) {
+		pg = (void *) words;
+		perm |= IPC_WORDS;
 	}
-	spin_unlock(&ipc_lock);
+	if (rcv_pg == NULL) rcv_pg = (void*)-1;
+	r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg, &value,
+			       words_store);
+	ipc_stores(r, from_env_store, perm_store);
+	return r < 0 ? r : value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -73,7 +180,7 @@ envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
+	for (i = 0; i < envtabs->et_nenv; i++)
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
 	return 0;
@@ -6,7 +6,8 @@
  *
  * Uses the address space to do most of the hard work.
  * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
+ * in order.  Pages are reserved as demand-zero memory (so
+ * they take no physical memory until touched), used to fill successive
  * malloc requests, and then left alone.  Free decrements
  * a ref count maintained in the page; the page is freed
  * when the ref count hits zero.
@@ -33,7 +34,7 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & (PTE_P|PTE_ANON))))
 			return 0;
 	return 1;
 }
@@ -41,7 +42,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int i, last;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
@@ -93,18 +94,19 @@ malloc(size_t n)
 	}
 
 	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * reserve at mptr - the +4 makes sure we reserve a ref count.
+	 * all pages but the last are PTE_CONTINUED.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	last = ROUNDDOWN(n + 4 - 1, PGSIZE);
+	if ((last > 0 && sys_page_reserve(0, mptr, last,
+					  PTE_P|PTE_U|PTE_W|PTE_CONTINUED) < 0)
+	    || sys_page_reserve(0, mptr + last, PGSIZE, PTE_P|PTE_U|PTE_W) < 0) {
+		for (i = 0; i <= last; i += PGSIZE)
+			sys_page_unmap(0, mptr + i);
+		return 0;	/* out of physical memory */
 	}
 
-	ref = (uint32_t*) (mptr + i - 4);
+	ref = (uint32_t*) (mptr + last + PGSIZE - 4);
 	*ref = 2;	/* reference for mptr, reference for returned block */
 	v = mptr;
 	mptr += n;
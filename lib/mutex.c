@@ -0,0 +1,82 @@
+// Blocking mutexes and condition variables on top of sys_futex_wait
+// and sys_futex_wake.
+
+#include <inc/lib.h>
+
+// Mutexes follow Drepper's "Futexes Are Tricky": a thread that finds the
+// mutex held marks it contended (2) before sleeping, so that unlocking
+// only costs a system call if somebody may be asleep.
+void
+mutex_lock(mutex_t *m)
+{
+	uint32_t c;
+
+	if ((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+		return;
+	if (c != 2)
+		c = xchg(&m->state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->state, 2, 0);
+		c = xchg(&m->state, 2);
+	}
+}
+
+// Returns 0 if it got the mutex, -E_AGAIN if somebody else holds it.
+int
+mutex_trylock(mutex_t *m)
+{
+	return __sync_val_compare_and_swap(&m->state, 0, 1) == 0 ? 0 : -E_AGAIN;
+}
+
+void
+mutex_unlock(mutex_t *m)
+{
+	if (xchg(&m->state, 0) == 2)
+		sys_futex_wake(&m->state, 1);
+}
+
+// Take m back after a wait on a condition variable.  Other threads may
+// have been waiting with us, so assume the mutex is contended.
+static void
+mutex_relock(mutex_t *m)
+{
+	while (xchg(&m->state, 2) != 0)
+		sys_futex_wait(&m->state, 2, 0);
+}
+
+// Atomically release m and wait for a signal on c, then take m again.
+// Like any condition variable wait this can return spuriously.
+void
+cond_wait(cond_t *c, mutex_t *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+// cond_wait for at most msec milliseconds, or forever if msec is 0.
+// Returns 0, or -E_TIMEOUT if the time ran out.
+int
+cond_timedwait(cond_t *c, mutex_t *m, uint32_t msec)
+{
+	uint32_t seq = c->seq;
+	int r;
+
+	mutex_unlock(m);
+	// A signal after we read seq changes it and makes this return
+	r = sys_futex_wait(&c->seq, seq, msec);
+	mutex_relock(m);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_signal(cond_t *c)
+{
+	__sync_fetch_and_add(&c->seq, 1);
+	sys_futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(cond_t *c)
+{
+	__sync_fetch_and_add(&c->seq, 1);
+	sys_futex_wake(&c->seq, NTHD);
+}
@@ -13,10 +13,11 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
+static envid_t nsenv;
+
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
@@ -25,19 +26,51 @@ nsipc(unsigned type)
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Send a small request, whose body is the 'n' bytes at 'req', to the
+// network server in registers rather than in nsipcbuf, so that no page
+// is mapped for it.  net/serv.c takes only the requests that need no
+// reply data this way.
+// Returns 0 if successful, < 0 on failure.
+static int
+nsipc_small(unsigned type, const void *req, size_t n)
+{
+	uint32_t buf[IPC_NWORDS];
+
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+
+	assert(n <= sizeof(buf));
+	memset(buf, 0, sizeof(buf));
+	memmove(buf, req, n);
+
+	if (debug)
+		cprintf("[%08x] nsipc_small %d\n", thisenv->env_id, type);
+
+	return ipc_callw(nsenv, type, buf, NULL);
 }
 
 int
 nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+	struct Nsret_accept *ret = &nsipcbuf.acceptRet;
+	struct Nsret_accept ringret;
 	int r;
 
-	nsipcbuf.accept.req_s = s;
-	nsipcbuf.accept.req_addrlen = *addrlen;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0) {
-		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
+	if (nsring_active()) {
+		struct Nsreq_accept req = { s, *addrlen };
+
+		r = nsring_call(NSREQ_ACCEPT, &req, sizeof(req),
+				&ringret, sizeof(ringret));
+		ret = &ringret;
+	} else {
+		nsipcbuf.accept.req_s = s;
+		nsipcbuf.accept.req_addrlen = *addrlen;
+		r = nsipc(NSREQ_ACCEPT);
+	}
+	if (r >= 0) {
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
 	}
@@ -47,6 +80,15 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 int
 nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 {
+	if (nsring_active() && namelen <= sizeof(struct sockaddr)) {
+		struct Nsreq_bind req;
+
+		req.req_s = s;
+		memmove(&req.req_name, name, namelen);
+		req.req_namelen = namelen;
+		return nsring_call(NSREQ_BIND, &req, sizeof(req), NULL, 0);
+	}
+
 	nsipcbuf.bind.req_s = s;
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
@@ -56,21 +98,35 @@ nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
-	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	struct Nsreq_shutdown req = { s, how };
+
+	if (nsring_active())
+		return nsring_call(NSREQ_SHUTDOWN, &req, sizeof(req), NULL, 0);
+	return nsipc_small(NSREQ_SHUTDOWN, &req, sizeof(req));
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	struct Nsreq_close req = { s };
+
+	if (nsring_active())
+		return nsring_call(NSREQ_CLOSE, &req, sizeof(req), NULL, 0);
+	return nsipc_small(NSREQ_CLOSE, &req, sizeof(req));
 }
 
 int
 nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
+	if (nsring_active() && namelen <= sizeof(struct sockaddr)) {
+		struct Nsreq_connect req;
+
+		req.req_s = s;
+		memmove(&req.req_name, name, namelen);
+		req.req_namelen = namelen;
+		return nsring_call(NSREQ_CONNECT, &req, sizeof(req), NULL, 0);
+	}
+
 	nsipcbuf.connect.req_s = s;
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
@@ -80,9 +136,11 @@ nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
-	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	struct Nsreq_listen req = { s, backlog };
+
+	if (nsring_active())
+		return nsring_call(NSREQ_LISTEN, &req, sizeof(req), NULL, 0);
+	return nsipc_small(NSREQ_LISTEN, &req, sizeof(req));
 }
 
 int
@@ -90,6 +148,15 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
 	int r;
 
+	// A receive that fits in a ring slot needs no page
+	if (nsring_active() && len >= 0 && len <= NSSLOT_BODY) {
+		struct Nsreq_recv req = { s, len, flags };
+
+		if ((r = nsring_call(NSREQ_RECV, &req, sizeof(req), mem, len)) >= 0)
+			assert(r <= len);
+		return r;
+	}
+
 	nsipcbuf.recv.req_s = s;
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
@@ -105,6 +172,21 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
+	if (nsring_active() &&
+	    size <= NSSLOT_BODY - offsetof(struct Nsreq_send, req_buf)) {
+		struct Nsreq_send *req;
+		char body[NSSLOT_BODY] __attribute__((aligned(sizeof(uint32_t))));
+
+		req = (struct Nsreq_send *) body;
+		req->req_s = s;
+		req->req_size = size;
+		req->req_flags = flags;
+		memmove(req->req_buf, buf, size);
+		return nsring_call(NSREQ_SEND, body,
+				   offsetof(struct Nsreq_send, req_buf) + size,
+				   NULL, 0);
+	}
+
 	nsipcbuf.send.req_s = s;
 	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
@@ -116,8 +198,9 @@ nsipc_send(int s, const void *buf, int size, unsigned int flags)
 int
 nsipc_socket(int domain, int type, int protocol)
 {
-	nsipcbuf.socket.req_domain = domain;
-	nsipcbuf.socket.req_type = type;
-	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	struct Nsreq_socket req = { domain, type, protocol };
+
+	if (nsring_active())
+		return nsring_call(NSREQ_SOCKET, &req, sizeof(req), NULL, 0);
+	return nsipc_small(NSREQ_SOCKET, &req, sizeof(req));
 }
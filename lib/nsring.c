@@ -0,0 +1,129 @@
+// Request rings to the network server, which work like those to the
+// file server (see lib/fsring.c): nsring_open shares a page of request
+// slots with the server once, and from then on a socket request is
+// posted in a free slot and the server told by bumping the doorbell.
+// The server's ring thread queues posted requests for its main loop
+// like those that come by IPC, and the reply lands in the slot.
+//
+// The socket functions use the ring on their own once it is open, for
+// requests whose body and reply fit in a slot.
+
+#include <inc/ns.h>
+#include <inc/lib.h>
+
+// At NSRINGVA for the same reasons as the file server's (see
+// lib/fsring.c)
+static struct Nsring *const ring = (struct Nsring *) NSRINGVA;
+static bool nsring_on;
+
+// Set up the request ring, if it isn't already.
+// Returns 0 on success, < 0 on error.
+int
+nsring_open(void)
+{
+	static envid_t nsenv;
+	int r;
+
+	static_assert(sizeof(struct Nsring) == PGSIZE);
+	if (nsring_on)
+		return 0;
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+
+	// A fresh page, shared with the children we fork
+	if ((r = sys_page_alloc(0, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	if ((r = ipc_call(nsenv, NSREQ_RING, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE,
+			  NULL, NULL)) < 0) {
+		sys_page_unmap(0, ring);
+		return r;
+	}
+	nsring_on = 1;
+	return 0;
+}
+
+// Is the request ring open?
+bool
+nsring_active(void)
+{
+	return nsring_on;
+}
+
+// Post a request of the given type, whose body is the 'n' bytes at 'req',
+// in a free slot of the ring, waiting for one if need be.
+// Returns the slot, to pass to nsring_wait.
+int
+nsring_submit(unsigned type, const void *req, size_t n)
+{
+	struct Nsslot *slot;
+	uint32_t free;
+	int i;
+
+	assert(nsring_on && n <= NSSLOT_BODY);
+	while (1) {
+		free = ring->nr_free;
+		for (i = 0; i < NSRING_NSLOT; i++)
+			if (ring->nr_slots[i].ns_state == NSSLOT_FREE &&
+			    __sync_bool_compare_and_swap(&ring->nr_slots[i].ns_state,
+							 NSSLOT_FREE, NSSLOT_FILL))
+				break;
+		if (i < NSRING_NSLOT)
+			break;
+		// All taken by requests in flight: sleep until one is
+		// freed, unless one just has been
+		if ((free & 1) ||
+		    __sync_bool_compare_and_swap(&ring->nr_free, free, free | 1))
+			sys_futex_wait(&ring->nr_free, free | 1, 0);
+	}
+
+	slot = &ring->nr_slots[i];
+	slot->ns_type = type;
+	memmove(slot->ns_body, req, n);
+	// The server must see the request before the slot posted
+	__sync_synchronize();
+	slot->ns_state = NSSLOT_REQ;
+	if (__sync_fetch_and_add(&ring->nr_doorbell, 2) & 1)
+		sys_futex_wake(&ring->nr_doorbell, 1);
+	return i;
+}
+
+// Wait for the reply to the request posted in slot i, copy the first 'n'
+// bytes of it to 'ret', if nonnull, and free the slot.
+// Returns the result from the network server.
+int
+nsring_wait(int i, void *ret, size_t n)
+{
+	struct Nsslot *slot = &ring->nr_slots[i];
+	uint32_t s;
+	int r;
+
+	assert(n <= NSSLOT_BODY);
+	while ((s = slot->ns_state) != NSSLOT_DONE) {
+		if (!(s & NSSLOT_WAIT) &&
+		    !__sync_bool_compare_and_swap(&slot->ns_state, s, s | NSSLOT_WAIT))
+			continue;
+		sys_futex_wait(&slot->ns_state, s | NSSLOT_WAIT, 0);
+	}
+
+	// Read the reply only after seeing it done, and all of it before
+	// the slot can be taken again
+	__sync_synchronize();
+	if (ret)
+		memmove(ret, slot->ns_body, n);
+	r = slot->ns_ret;
+	__sync_synchronize();
+	slot->ns_state = NSSLOT_FREE;
+	if (__sync_fetch_and_add(&ring->nr_free, 2) & 1) {
+		__sync_fetch_and_and(&ring->nr_free, ~1);
+		sys_futex_wake(&ring->nr_free, NTHD);
+	}
+	return r;
+}
+
+// Make a request through the ring and wait for its reply, as
+// nsring_submit and nsring_wait do.
+int
+nsring_call(unsigned type, const void *req, size_t n, void *ret, size_t retn)
+{
+	return nsring_wait(nsring_submit(type, req, n), ret, retn);
+}
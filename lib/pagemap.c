@@ -0,0 +1,43 @@
+// Batch sys_page_map calls into sys_page_map_vec.
+
+#include <inc/lib.h>
+
+void
+pagemap_init(struct PageMapVec *v)
+{
+	v->n = 0;
+}
+
+// Queue up the mapping of our page at srcva at dstva in dstenv.
+// Returns what pagemap_flush does if this fills v, 0 otherwise.
+int
+pagemap_add(struct PageMapVec *v, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	struct PageMapOp *op = &v->ops[v->n++];
+
+	op->pm_srcva = srcva;
+	op->pm_dstenv = dstenv;
+	op->pm_dstva = dstva;
+	op->pm_perm = perm;
+	if (v->n == PAGE_MAP_VEC_MAX)
+		return pagemap_flush(v);
+	return 0;
+}
+
+// Carry out the queued mappings.  Returns 0 if all of them worked, else
+// the error of the first that failed.
+int
+pagemap_flush(struct PageMapVec *v)
+{
+	int i, r;
+
+	if (v->n == 0)
+		return 0;
+	r = sys_page_map_vec(v->ops, v->n);
+	if (r > 0)
+		for (i = 0; i < v->n; i++)
+			if ((r = v->ops[i].pm_status) < 0)
+				break;
+	v->n = 0;
+	return r;
+}
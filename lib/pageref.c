@@ -7,7 +7,11 @@ pageref(void *v)
 
 	if (!(uvpd[PDX(v)] & PTE_P))
 		return 0;
-	pte = uvpt[PGNUM(v)];
+	// A 4MB page's references are counted on its first page
+	if (uvpd[PDX(v)] & PTE_PS)
+		pte = uvpd[PDX(v)];
+	else
+		pte = uvpt[PGNUM(v)];
 	if (!(pte & PTE_P))
 		return 0;
 	return pages[PGNUM(pte)].pp_ref;
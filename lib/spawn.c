@@ -267,6 +267,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 {
 	int i, r;
 	void *blk;
+	struct PageMapVec v;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -277,24 +278,36 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
+	// Read the file pages PAGE_MAP_VEC_MAX at a time into a demand-zero
+	// window at UTEMP and hand each batch over in one system call.
+	// Reserving the window again drops our references to the last one.
+	pagemap_init(&v);
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
+			// the rest is bss: reserve it demand-zero
+			break;
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			blk = UTEMP + (i / PGSIZE % PAGE_MAP_VEC_MAX) * PGSIZE;
+			if (blk == UTEMP &&
+			    (r = sys_page_reserve(0, UTEMP, PAGE_MAP_VEC_MAX * PGSIZE,
+						  PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+			if ((r = readn(fd, blk, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+			if ((r = pagemap_add(&v, blk, child, (void*) (va + i), perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
 		}
 	}
+	if ((r = pagemap_flush(&v)) < 0)
+		panic("spawn: sys_page_map data: %e", r);
+	if (i > 0 && (r = sys_page_reserve(0, UTEMP, PAGE_MAP_VEC_MAX * PGSIZE,
+					   PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if (i < memsz)
+		return sys_page_reserve(child, (void*) (va + i), memsz - i, perm);
 	return 0;
 }
 
@@ -305,13 +318,34 @@ copy_shared_pages(envid_t child)
 	// LAB 5: Your code here.
 	// 直接暴力找即可
 	int r;
+	struct PageMapVec v;
+
+	pagemap_init(&v);
 	for (uintptr_t addr = 0; addr < UTOP; addr += PGSIZE){
+		// Nothing in this page table
+		if (!(uvpd[PDX(addr)] & PTE_P)) {
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		// 4MB pages are shared whole
+		if ((uvpd[PDX(addr)] & PTE_P) && (uvpd[PDX(addr)] & PTE_PS)) {
+			if ((uvpd[PDX(addr)] & PTE_SHARE) &&
+			    (r = sys_page_map(0, (void*)addr, child, (void*)addr,
+					      uvpd[PDX(addr)] & (PTE_SYSCALL | PTE_PS))) < 0)
+				return r;
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		// A request ring belongs to the program that opened it; the
+		// server serves it until nobody else maps it
+		if (addr == FSRINGVA || addr == NSRINGVA)
+			continue;
 		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) &&
 				(uvpt[PGNUM(addr)] & PTE_U) && (uvpt[PGNUM(addr)] & PTE_SHARE)) {
-			if ((r = sys_page_map(0, (void*)addr, child, (void*)addr, (uvpt[PGNUM(addr)] & PTE_SYSCALL))) < 0)
+			if ((r = pagemap_add(&v, (void*)addr, child, (void*)addr, (uvpt[PGNUM(addr)] & PTE_SYSCALL))) < 0)
 				return r;
 		}
 	}
-	return 0;
+	return pagemap_flush(&v);
 }
 
@@ -37,6 +37,46 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	return ret;
 }
 
+// The IPC system calls that receive return the message in the registers
+// the arguments went in: the value in DX and its words in CX, BX, DI
+// and SI.  If the call succeeds, store the value in *value_store and
+// the words in words_store, each if nonnull.
+static inline int32_t
+ipc_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5,
+	    uint32_t *value_store, uint32_t *words_store)
+{
+	int32_t ret;
+	uint32_t value, w0, w1, w2, w3;
+
+	asm volatile("int %6\n"
+		     : "=a" (ret),
+		       "=d" (value),
+		       "=c" (w0),
+		       "=b" (w1),
+		       "=D" (w2),
+		       "=S" (w3)
+		     : "i" (T_SYSCALL),
+		       "0" (num),
+		       "1" (a1),
+		       "2" (a2),
+		       "3" (a3),
+		       "4" (a4),
+		       "5" (a5)
+		     : "cc", "memory");
+
+	if (ret < 0)
+		return ret;
+	if (value_store)
+		*value_store = value;
+	if (words_store) {
+		words_store[0] = w0;
+		words_store[1] = w1;
+		words_store[2] = w2;
+		words_store[3] = w3;
+	}
+	return ret;
+}
+
 void
 sys_cputs(const char *s, size_t len)
 {
@@ -106,9 +146,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 }
 
 int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t *value_store, uint32_t *words_store)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return ipc_syscall(SYS_ipc_recv, (uint32_t)dstva, 0, 0, 0, 0,
+			   value_store, words_store);
 }
 
 unsigned int
@@ -147,4 +188,66 @@ int sys_thd_set_trapframe(thdid_t tid, struct Trapframe * tf) {
 
 int sys_thd_set_uxstack(thdid_t tid,uintptr_t uxstack) {
 	 return syscall(SYS_thd_set_uxstack,1,tid,uxstack,0, 0, 0);
-}
\ No newline at end of file
+}
+
+int sys_thd_set_priority(thdid_t tid, int prio) {
+	return syscall(SYS_thd_set_priority, 1, tid, prio, 0, 0, 0);
+}
+
+int sys_thd_sleep(uint32_t msec) {
+	return syscall(SYS_thd_sleep, 0, msec, 0, 0, 0, 0);
+}
+
+int sys_thd_set_affinity(thdid_t tid, uint32_t cpumask) {
+	return syscall(SYS_thd_set_affinity, 1, tid, cpumask, 0, 0, 0);
+}
+
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val, uint32_t timeout) {
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, timeout, 0, 0);
+}
+
+int sys_futex_wake(volatile uint32_t *addr, int n) {
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+// Unlike sys_exofork this need not be inlined: the kernel copies our
+// stack in the same trap, before we return into it.
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_vec(struct PageMapOp *ops, int n)
+{
+	return syscall(SYS_page_map_vec, 0, (uint32_t) ops, n, 0, 0, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva,
+	     uint32_t *value_store, uint32_t *words_store)
+{
+	return ipc_syscall(SYS_ipc_call, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva,
+			   value_store, words_store);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva,
+		   uint32_t *value_store, uint32_t *words_store)
+{
+	return ipc_syscall(SYS_ipc_reply_wait, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva,
+			   value_store, words_store);
+}
@@ -3,14 +3,20 @@
 #define THREAD_MAX (PTSIZE / 4)
 
 volatile int thread_used_stack[THREAD_MAX];
-spinlock_t thread_lock = 0;
+mutex_t thread_lock;
 
 static int get_empty_thread_position();
 
+// Block until thread tar has exited.  The kernel wakes futex waiters
+// on a thread's (read-only) thd_status when it frees the thread.
+// Read the status before the id: if the slot has been reused since,
+// the id check sees it, and we don't wait for the new thread.
 void wait_thread(thdid_t tar) {
-	int p = THDX(tar);
-	while(thds[p].thd_status != THD_FREE && thds[p].thd_id == tar)
-		sys_yield();
+	const volatile struct Thd *t = &thds[THDX(tar)];
+	uint32_t s;
+
+	while ((s = t->thd_status) != THD_FREE && t->thd_id == tar)
+		sys_futex_wait((volatile uint32_t *) &t->thd_status, s, 0);
 }
 
 static void thread_start(void(*func)(void*), void *para) {
@@ -22,20 +28,21 @@ thdid_t create_thread(void(*func)(void*), void*para) {
 	thdid_t child = sys_thd_create();
 	if (child < 0)
 		return child;
-    spin_lock(&thread_lock);
+    mutex_lock(&thread_lock);
 	int p = get_empty_thread_position();
 	if (p < 0)
 		panic("create_thread error 0: Do not have thread space for new thread!");
 	thread_used_stack[p] = child;
-    spin_unlock(&thread_lock);
+    mutex_unlock(&thread_lock);
 	int r;
 	if (!((uvpd[PDX(UTXSTACKTOP(p) - PGSIZE)] & PTE_P) && (uvpt[PGNUM(UTXSTACKTOP(p) - PGSIZE)] & PTE_P))) {
 		r = sys_page_alloc(0, (void*)(UTXSTACKTOP(p) - PGSIZE), PTE_P | PTE_U | PTE_W);
 		if (r < 0)
 			panic(" create_thread error 1: %e", r);
 	}
-	if (!((uvpd[PDX(UTSTACKTOP(p) - PGSIZE)] & PTE_P) && (uvpt[PGNUM(UTSTACKTOP(p) - PGSIZE)] & PTE_P))) {
-		r = sys_page_alloc(0, (void*)(UTSTACKTOP(p) - PGSIZE), PTE_P | PTE_U | PTE_W);
+	// The stack is demand-zero: it gets memory as the thread uses it
+	if (!((uvpd[PDX(UTSTACKTOP(p) - PGSIZE)] & PTE_P) && (uvpt[PGNUM(UTSTACKTOP(p) - PGSIZE)] & (PTE_P | PTE_ANON)))) {
+		r = sys_page_reserve(0, (void*)(UTSTACKTOP(p) - PGSIZE), PGSIZE, PTE_P | PTE_U | PTE_W);
 		if (r < 0)
 			panic(" create_thread error 2: %e", r);
 	}
@@ -5,13 +5,11 @@ extern union Nsipc nsipcbuf;
 void
 sleep(int msec)//简单的延迟函数
 {
-       unsigned now = sys_time_msec();
-       unsigned end = now + msec;
+       int r;
 
-       if ((int)now < 0 && (int)now > -MAXERROR)
-               panic("sys_time_msec: %e", (int)now);
-       while (sys_time_msec() < end)
-               sys_yield();
+       // Block in the kernel rather than spinning on sys_yield
+       if ((r = sys_thd_sleep(msec)) < 0)
+               panic("sys_thd_sleep: %e", r);
 }
 
 void
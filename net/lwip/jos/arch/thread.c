@@ -10,6 +10,10 @@ static struct thread_context *cur_tc;
 static struct thread_queue thread_queue;
 static struct thread_queue kill_queue;
 
+// Bumped by thread_kick, for a thread_wait that sleeps in the kernel
+// to wait on along with its timeout
+static volatile uint32_t kick_seq;
+
 void
 thread_init(void) {
     threadq_init(&thread_queue);
@@ -31,12 +35,44 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// Is every thread, the caller included, stuck in thread_wait?  Then
+// only a timeout can get any of them going again; the earliest one is
+// returned in *until.
+static int
+thread_all_waiting(uint32_t *until)
+{
+    struct thread_context *tc;
+
+    *until = cur_tc->tc_wait_until;
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link) {
+	if (!tc->tc_waiting || tc->tc_wakeup)
+	    return 0;
+	if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	    return 0;
+	if (tc->tc_wait_until < *until)
+	    *until = tc->tc_wait_until;
+    }
+    return 1;
+}
+
+// Called by another kernel thread of this env after changing a word that
+// a thread may be waiting on, since it can't use thread_wakeup.
+void
+thread_kick(void) {
+    __sync_fetch_and_add(&kick_seq, 1);
+    sys_futex_wake(&kick_seq, 1);
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
     uint32_t s = sys_time_msec();
     uint32_t p = s;
+    uint32_t until, kick;
 
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_until = msec;
+    cur_tc->tc_waiting = 1;
     cur_tc->tc_wakeup = 0;
 
     while (p < msec) {
@@ -47,11 +83,18 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
+	// Rather than spin through thread_yield, sleep in the kernel
+	// until the first of us times out or thread_kick is called.
+	kick = kick_seq;
+	if (thread_all_waiting(&until) && until > p)
+	    sys_futex_wait(&kick_seq, kick, until - p);
+
 	thread_yield();
 	p = sys_time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
+    cur_tc->tc_waiting = 0;
     cur_tc->tc_wakeup = 0;
 }
 
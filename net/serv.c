@@ -51,11 +51,47 @@ static bool buse[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
 static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
 
+// Request rings set up with NSREQ_RING are mapped at RINGVA + i * PGSIZE
+// and watched by a thread of their own, which queues the requests
+// posted in them with the rest.  Out of malloc's way (see lib/malloc.c),
+// which would hand out a ring's address once the ring is gone.
+#define RINGVA		0x11000000
+#define MAXRING		16
+// How often the thread of an idle ring checks whether it still has a
+// client
+#define RING_IDLE_MSEC	1000
+
+static envid_t ringenv[MAXRING];	// Env that set up ring i, or 0
+static int ringbusy[MAXRING];		// Requests of ring i being served
+
+// Requests received by recv_thread or posted in a ring, oldest first,
+// for serve.  Every request from recv_thread holds a buffer, and every
+// ring has at most NSRING_NSLOT requests in flight, which bounds the
+// queue.
+struct nsreq {
+	int32_t reqno;
+	envid_t whom;
+	thdid_t client;		// Thread to reply to
+	void *va;
+	int perm;
+	uint32_t words[IPC_NWORDS];	// Body of a small request, see nsreq_small
+	struct Nsslot *slot;	// Slot a ring request was posted in, or NULL
+	int ring;
+};
+static struct nsreq reqq[QUEUE_SIZE + MAXRING * NSRING_NSLOT];
+static int reqq_head, reqq_count;
+static volatile uint32_t reqq_seq;	// Bumped for every request queued
+
+// Protects the request queue, buse[] and ringbusy[], which recv_thread
+// and the ring threads share with the lwIP threads
+static mutex_t req_lock;
+
 static void *
 get_buffer(void) {
 	void *va;
 
 	int i;
+	mutex_lock(&req_lock);
 	for (i = 0; i < QUEUE_SIZE; i++)
 		if (!buse[i]) break;
 
@@ -66,6 +102,7 @@ get_buffer(void) {
 
 	va = (void *)(REQVA + i * PGSIZE);
 	buse[i] = 1;
+	mutex_unlock(&req_lock);
 
 	return va;
 }
@@ -73,7 +110,9 @@ get_buffer(void) {
 static void
 put_buffer(void *va) {
 	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	mutex_lock(&req_lock);
 	buse[i] = 0;
+	mutex_unlock(&req_lock);
 }
 
 static void
@@ -180,9 +219,51 @@ process_timer(envid_t envid) {
 struct st_args {
 	int32_t reqno;
 	uint32_t whom;
+	thdid_t client;
 	union Nsipc *req;
+	uint32_t words[IPC_NWORDS];	// req, for a small request
+	struct Nsslot *slot;	// For a ring request, where to reply
+	int ring;
+	// req, for a ring request
+	uint32_t body[NSSLOT_BODY / sizeof(uint32_t)];
 };
 
+// May request reqno come in registers, without an argument page?  Only
+// if its body fits in IPC_NWORDS words and it returns nothing but r.
+static bool
+nsreq_small(int32_t reqno)
+{
+	switch (reqno) {
+	case NSREQ_SHUTDOWN:
+	case NSREQ_CLOSE:
+	case NSREQ_LISTEN:
+	case NSREQ_SOCKET:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Reply r to the request in slot of ring i, with the first NSSLOT_BODY
+// bytes of what the request left at body.
+static void
+ring_reply(struct Nsslot *slot, int i, const void *body, int r)
+{
+	uint32_t s;
+
+	// xchg is a full barrier: the reply is there before the slot is
+	// seen done
+	memmove(slot->ns_body, body, NSSLOT_BODY);
+	slot->ns_ret = r;
+	s = xchg(&slot->ns_state, NSSLOT_DONE);
+	if (s & NSSLOT_WAIT)
+		sys_futex_wake(&slot->ns_state, 1);
+
+	mutex_lock(&req_lock);
+	ringbusy[i]--;
+	mutex_unlock(&req_lock);
+}
+
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
@@ -246,57 +327,258 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	// A client that has gone away gets no reply
+	if (args->slot)
+		ring_reply(args->slot, args->ring, args->body, r);
+	else if (args->reqno != NSREQ_INPUT)
+		sys_ipc_send(args->client, r, (void *) -1, IPC_THD);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if (args->req != (union Nsipc *) args->words &&
+	    args->req != (union Nsipc *) args->body) {
+		put_buffer(args->req);
+		sys_page_unmap(0, (void*) args->req);
+	}
 	free(args);
 }
 
-void
-serve(void) {
+// Wait for requests in a kernel thread of our own and queue them for
+// serve.  The lwIP threads all run in the main kernel thread, which
+// must not block in ipc_recv.
+static void
+recv_thread(void *arg) {
+	struct nsreq *q;
+	uint32_t q_words[IPC_NWORDS];
 	int32_t reqno;
-	uint32_t whom;
-	int i, perm;
+	envid_t whom;
+	int perm;
 	void *va;
 
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
-		// all pending work from other threads.  We limit the
-		// number of yields in case there's a rogue thread.
-		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
-			thread_yield();
-
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_recvw(&whom, va, &perm, q_words);
+
+		mutex_lock(&req_lock);
+		q = &reqq[(reqq_head + reqq_count++) % ARRAY_SIZE(reqq)];
+		memset(q, 0, sizeof(*q));
+		q->reqno = reqno;
+		q->whom = whom;
+		q->client = thisthd->thd_ipc_from_thd;
+		q->va = va;
+		q->perm = perm;
+		memmove(q->words, q_words, sizeof(q->words));
+		reqq_seq++;
+		mutex_unlock(&req_lock);
+		thread_kick();
+	}
+}
+
+// Queue the requests posted in ring i for serve, a batch at a time,
+// until none of its clients maps it any more and none of its requests
+// is still being served.  Runs in a kernel thread of its own, like
+// recv_thread.
+static void
+ring_thread(void *arg)
+{
+	int i = (int) arg;
+	struct Nsring *ring = (struct Nsring *) (RINGVA + i * PGSIZE);
+	struct Nsslot *slot;
+	struct nsreq *q;
+	uint32_t bell, s;
+	int n, busy;
+
+	while (1) {
+		mutex_lock(&req_lock);
+		busy = ringbusy[i];
+		mutex_unlock(&req_lock);
+		if (pageref(ring) <= 1 && busy == 0)
+			break;
+
+		bell = ring->nr_doorbell & ~1;
+		__sync_synchronize();
+		n = 0;
+		for (slot = ring->nr_slots; slot < ring->nr_slots + NSRING_NSLOT; slot++) {
+			// The client may or in NSSLOT_WAIT meanwhile
+			s = slot->ns_state;
+			if ((s & ~NSSLOT_WAIT) != NSSLOT_REQ ||
+			    !__sync_bool_compare_and_swap(&slot->ns_state, s,
+				    (s & NSSLOT_WAIT) | NSSLOT_SERVE))
+				continue;
+			mutex_lock(&req_lock);
+			q = &reqq[(reqq_head + reqq_count++) % ARRAY_SIZE(reqq)];
+			memset(q, 0, sizeof(*q));
+			q->reqno = slot->ns_type;
+			q->whom = ringenv[i];
+			q->slot = slot;
+			q->ring = i;
+			ringbusy[i]++;
+			reqq_seq++;
+			mutex_unlock(&req_lock);
+			n++;
+		}
+		if (n > 0) {
+			thread_kick();
+			continue;
+		}
+
+		// Sleep until a client rings, unless one just has
+		if (__sync_bool_compare_and_swap(&ring->nr_doorbell, bell, bell | 1)) {
+			sys_futex_wait(&ring->nr_doorbell, bell | 1, RING_IDLE_MSEC);
+			__sync_fetch_and_and(&ring->nr_doorbell, ~1);
+		}
+	}
+
+	sys_page_unmap(0, ring);
+	mutex_lock(&req_lock);
+	ringenv[i] = 0;
+	mutex_unlock(&req_lock);
+}
+
+// Take over the request page at va, which envid shares with us, as a
+// request ring, and start a thread to watch it.
+static int
+serve_ring_open(envid_t envid, void *va)
+{
+	struct Nsring *ring;
+	int i, r;
+
+	mutex_lock(&req_lock);
+	for (i = 0; i < MAXRING; i++)
+		if (!ringenv[i])
+			break;
+	if (i < MAXRING)
+		ringenv[i] = envid;
+	mutex_unlock(&req_lock);
+	if (i == MAXRING)
+		return -E_MAX_OPEN;
+
+	ring = (struct Nsring *) (RINGVA + i * PGSIZE);
+	// Its thread looks at the page's references to tell when it is
+	// no longer used, so va must be unmapped by the time it starts
+	if ((r = sys_page_map(0, va, 0, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		goto fail;
+	sys_page_unmap(0, va);
+	if ((r = create_thread(ring_thread, (void *) i)) < 0) {
+		sys_page_unmap(0, ring);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	mutex_lock(&req_lock);
+	ringenv[i] = 0;
+	mutex_unlock(&req_lock);
+	return r;
+}
+
+// Hand the request posted in a ring slot, which q holds, to a thread of
+// its own, as serve does for the others.  The request is copied out of
+// the shared page first, so that the client can't change it under the
+// handler, and has its size cut down so that the reply fits.
+static void
+serve_ring_req(struct nsreq *q)
+{
+	struct st_args *args;
+	union Nsipc *req;
+
+	args = malloc(sizeof(struct st_args));
+	if (!args)
+		panic("could not allocate thread args structure");
+	args->reqno = q->reqno;
+	args->whom = q->whom;
+	args->client = 0;
+	args->slot = q->slot;
+	args->ring = q->ring;
+	args->req = req = (union Nsipc *) args->body;
+
+	// Read the request only after seeing it posted
+	__sync_synchronize();
+	memmove(args->body, q->slot->ns_body, NSSLOT_BODY);
+	if (args->reqno == NSREQ_RECV)
+		req->recv.req_len = MIN(req->recv.req_len, NSSLOT_BODY);
+	else if (args->reqno == NSREQ_SEND)
+		req->send.req_size = MIN(req->send.req_size,
+			NSSLOT_BODY - offsetof(struct Nsreq_send, req_buf));
+
+	if (args->reqno < NSREQ_ACCEPT || args->reqno > NSREQ_SOCKET) {
+		cprintf("Invalid ring request %d from %08x\n", args->reqno, args->whom);
+		ring_reply(args->slot, args->ring, args->body, -E_INVAL);
+		free(args);
+		return;
+	}
+
+	thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
+	thread_yield(); // let the thread created run
+}
+
+void
+serve(void) {
+	struct nsreq q;
+	uint32_t seq;
+	int r;
+
+	while (1) {
+		mutex_lock(&req_lock);
+		seq = reqq_seq;
+		if (reqq_count == 0) {
+			mutex_unlock(&req_lock);
+			// The other lwIP threads run meanwhile
+			thread_wait(&reqq_seq, seq, ~0);
+			continue;
+		}
+		q = reqq[reqq_head];
+		reqq_head = (reqq_head + 1) % ARRAY_SIZE(reqq);
+		reqq_count--;
+		mutex_unlock(&req_lock);
+
 		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
+			cprintf("ns req %d from %08x\n", q.reqno, q.whom);
+		}
+
+		if (q.slot) {
+			serve_ring_req(&q);
+			continue;
 		}
 
 		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
-			process_timer(whom);
-			put_buffer(va);
+		if (q.reqno == NSREQ_TIMER) {
+			process_timer(q.whom);
+			put_buffer(q.va);
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n", whom);
+		// All remaining requests must contain an argument page, but
+		// for small ones sent in registers
+		if (!(q.perm & PTE_P) && !nsreq_small(q.reqno)) {
+			cprintf("Invalid request from %08x: no argument page\n", q.whom);
+			put_buffer(q.va);
 			continue; // just leave it hanging...
 		}
 
+		if (q.reqno == NSREQ_RING) {
+			r = serve_ring_open(q.whom, q.va);
+			put_buffer(q.va);
+			sys_page_unmap(0, q.va);
+			sys_ipc_send(q.client, r, (void *) -1, IPC_THD);
+			continue;
+		}
+
 		// Since some lwIP socket calls will block, create a thread and
 		// process the rest of the request in the thread.
 		struct st_args *args = malloc(sizeof(struct st_args));
 		if (!args)
 			panic("could not allocate thread args structure");
 
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
+		args->reqno = q.reqno;
+		args->whom = q.whom;
+		args->client = q.client;
+		args->slot = NULL;
+		args->req = q.va;
+		if (!(q.perm & PTE_P)) {
+			memmove(args->words, q.words, sizeof(args->words));
+			args->req = (union Nsipc *) args->words;
+			put_buffer(q.va);
+		}
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -305,9 +587,13 @@ serve(void) {
 
 static void
 tmain(uint32_t arg) {
+	int r;
+
 	serve_init(inet_addr(IP),
 		   inet_addr(MASK),
 		   inet_addr(DEFAULT));
+	if ((r = create_thread(recv_thread, NULL)) < 0)
+		panic("create_thread: %e", r);
 	serve();
 }
 
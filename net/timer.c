@@ -8,11 +8,11 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 	binaryname = "ns_timer";
 
 	while (1) {
-		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
-		}
+		r = sys_time_msec();
 		if (r < 0)
 			panic("sys_time_msec: %e", r);
+		if ((uint32_t) r < stop)
+			sys_thd_sleep(stop - r);
 
 		ipc_send(ns_envid, NSREQ_TIMER, 0, 0);
 
@@ -1,9 +1,75 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+//
+// Started on its own, measure instead how the scheduler divides the CPU
+// between spinning envs of different priorities.  Run with
+// "make run-fairness CPUS=1" so that they have to share one CPU.
 
 #include <inc/lib.h>
 
+#define DURATION	2000	// msec
+
+static struct {
+	int prio;
+	uint32_t weight;	// See kern/sched.c
+} spinners[] = {
+	{ THD_PRIO_DEFAULT, 1024 },
+	{ THD_PRIO_DEFAULT, 1024 },
+	{ THD_PRIO_SERVER, 3121 },
+	{ 5, 335 },
+};
+#define NSPINNER	(sizeof(spinners) / sizeof(spinners[0]))
+
+static unsigned start;
+
+static void
+spin(int i)
+{
+	int r;
+
+	if ((r = sys_thd_set_priority(0, spinners[i].prio)) < 0)
+		panic("sys_thd_set_priority: %e", r);
+	while (sys_time_msec() < start)
+		sys_yield();
+	while (sys_time_msec() < start + DURATION)
+		/* spin */;
+	// Report in units of 1024 cycles to fit in an IPC value
+	ipc_send(thisenv->env_parent_id, thisthd->thd_runtime >> 10, 0, 0);
+	exit();
+}
+
+static void
+cpu_fairness(void)
+{
+	uint32_t runtime[NSPINNER], total_runtime = 0, total_weight = 0;
+	envid_t env[NSPINNER], who;
+	uint32_t i, j, n;
+
+	start = sys_time_msec() + 200;
+	for (i = 0; i < NSPINNER; i++) {
+		if ((env[i] = fork()) < 0)
+			panic("fork: %e", env[i]);
+		if (env[i] == 0)
+			spin(i);
+		total_weight += spinners[i].weight;
+	}
+
+	for (i = 0; i < NSPINNER; i++) {
+		n = ipc_recv(&who, 0, 0);
+		for (j = 0; j < NSPINNER; j++)
+			if (env[j] == who)
+				runtime[j] = n;
+		total_runtime += n;
+	}
+	for (i = 0; i < NSPINNER; i++) {
+		cprintf("%08x prio %3d: %3d%% of the CPU (fair share %3d%%)\n",
+			env[i], spinners[i].prio,
+			runtime[i] * 100 / total_runtime,
+			spinners[i].weight * 100 / total_weight);
+	}
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -11,7 +77,9 @@ umain(int argc, char **argv)
 
 	id = sys_getenvid();
 
-	if (thisenv == &envs[1]) {
+	if (thisenv == &envs[0]) {
+		cpu_fairness();
+	} else if (thisenv == &envs[1]) {
 		while (1) {
 			ipc_recv(&who, 0, 0);
 			cprintf("%x recv from %x\n", id, who);
@@ -22,4 +90,3 @@ umain(int argc, char **argv)
 			ipc_send(envs[1].env_id, 0, 0, 0);
 	}
 }
-
@@ -0,0 +1,85 @@
+// Measure how page allocation throughput scales with the number of CPUs.
+// Run with e.g. "make run-forkbench CPUS=4" and compare the totals for
+// 1 to 8 CPUs; the kernel monitor's pages command shows how often the
+// per-CPU page caches had to go to the global free lists.
+//
+// Several workers fork short-lived children as fast as they can for a
+// fixed amount of time.  Every fork copies the worker's page tables and
+// allocates the child's exception stack, and every child takes
+// copy-on-write faults on its data and allocates a few fresh pages
+// before it exits, so nearly all the time goes into allocating and
+// freeing physical pages.
+
+#include <inc/lib.h>
+
+#define NWORKER		8
+#define DURATION	1000	// msec
+#define NTOUCH		8	// Pages of buf each child writes
+#define NALLOC		8	// Fresh pages each child allocates
+#define TESTVA		((char *) 0x10000000)
+
+static char buf[NTOUCH * PGSIZE];
+static unsigned start;
+
+static void
+child(void)
+{
+	int i, r;
+
+	for (i = 0; i < NTOUCH; i++)
+		buf[i * PGSIZE] = i;
+	for (i = 0; i < NALLOC; i++)
+		if ((r = sys_page_alloc(0, TESTVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	exit();
+}
+
+static void
+worker(void)
+{
+	unsigned end = start + DURATION;
+	uint32_t nfork = 0;
+	envid_t id;
+
+	// Make our own data copy-on-write for the children
+	memset(buf, 0, sizeof(buf));
+
+	// Start everybody at the same time
+	while (sys_time_msec() < start)
+		sys_yield();
+
+	while (sys_time_msec() < end) {
+		if ((id = fork()) < 0)
+			panic("fork: %e", id);
+		if (id == 0)
+			child();
+		wait(id);
+		nfork++;
+	}
+	ipc_send(thisenv->env_parent_id, nfork, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t total = 0, n;
+	envid_t who;
+	int i;
+
+	// Leave time for the forks before the clock starts
+	start = sys_time_msec() + 200;
+	for (i = 0; i < NWORKER; i++)
+		if (fork() == 0) {
+			worker();
+			return;
+		}
+
+	for (i = 0; i < NWORKER; i++) {
+		n = ipc_recv(&who, 0, 0);
+		cprintf("%08x forked %u children\n", who, n);
+		total += n;
+	}
+	cprintf("forkbench: %u forks in %u msec (%u per sec)\n",
+		total, DURATION, total * 1000 / DURATION);
+}
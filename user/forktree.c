@@ -1,38 +1,60 @@
 // Fork a binary tree of processes and display their structure.
+//
+// Every process waits for its children, so once the root is done the
+// whole tree is, and the root prints how long that took.  Run with -u to
+// build the tree with the user-level ufork instead of fork and compare.
 
 #include <inc/lib.h>
 
 #define DEPTH 3
 
+static envid_t (*dofork)(void) = fork;
+
 void forktree(const char *cur);
 
-void
+envid_t
 forkchild(const char *cur, char branch)
 {
 	char nxt[DEPTH+1];
+	envid_t id;
 
 	if (strlen(cur) >= DEPTH)
-		return;
+		return 0;
 
 	snprintf(nxt, DEPTH+1, "%s%c", cur, branch);
-	if (fork() == 0) {
+	if ((id = dofork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
 		forktree(nxt);
 		exit();
 	}
+	return id;
 }
 
 void
 forktree(const char *cur)
 {
+	envid_t left, right;
+
 	cprintf("%04x: I am '%s'\n", sys_getenvid(), cur);
 
-	forkchild(cur, '0');
-	forkchild(cur, '1');
+	left = forkchild(cur, '0');
+	right = forkchild(cur, '1');
+	if (left)
+		wait(left);
+	if (right)
+		wait(right);
 }
 
 void
 umain(int argc, char **argv)
 {
+	unsigned start;
+
+	if (argc > 1 && strcmp(argv[1], "-u") == 0)
+		dofork = ufork;
+	start = sys_time_msec();
 	forktree("");
+	cprintf("forktree: %s took %u msec\n", dofork == fork ? "fork" : "ufork",
+		sys_time_msec() - start);
 }
-
@@ -0,0 +1,101 @@
+// Time small reads from a file: first the usual way, with a page mapped
+// and an IPC for every read, then through a request ring, one read at a
+// time and with NOUT of them outstanding at once.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(16 * PGSIZE)
+#define CHUNK		64
+#define NREAD		8192
+#define NOUT		8
+
+static char buf[NOUT][CHUNK];
+
+static void
+check(const char *what, int r, off_t off, const char *b)
+{
+	int i;
+
+	if (r != CHUNK)
+		panic("%s: read at %d returned %e", what, off, r);
+	for (i = 0; i < CHUNK; i++)
+		if (b[i] != (char) (off + i))
+			panic("%s: bad data at %d", what, off + i);
+}
+
+static void
+bench_read(const char *what, int fd)
+{
+	unsigned start;
+	off_t off;
+	int i;
+
+	seek(fd, 0);
+	start = sys_time_msec();
+	for (i = 0; i < NREAD; i++) {
+		off = (i * CHUNK) % FILESIZE;
+		if (off == 0)
+			seek(fd, 0);
+		check(what, read(fd, buf[0], CHUNK), off, buf[0]);
+	}
+	cprintf("fsbench: %s: %d reads of %d bytes in %u msec\n",
+		what, NREAD, CHUNK, sys_time_msec() - start);
+}
+
+// Keep NOUT reads in flight in the ring, straight through fsring_submit.
+static void
+bench_ring_batch(int fdnum)
+{
+	struct Fsreq_read req;
+	struct Fd *fd;
+	unsigned start;
+	int i, j, slot[NOUT];
+	off_t off;
+
+	if ((i = fd_lookup(fdnum, &fd)) < 0)
+		panic("fd_lookup: %e", i);
+	req.req_fileid = fd->fd_file.id;
+	req.req_n = CHUNK;
+
+	seek(fdnum, 0);
+	start = sys_time_msec();
+	for (i = 0; i < NREAD; i += NOUT) {
+		off = (i * CHUNK) % FILESIZE;
+		if (off == 0)
+			seek(fdnum, 0);
+		// The slots are all free, so the reads go into them in
+		// order, and the server takes posted slots in order too
+		for (j = 0; j < NOUT; j++)
+			slot[j] = fsring_submit(FSREQ_READ, &req, sizeof(req));
+		for (j = 0; j < NOUT; j++)
+			check("ring batch", fsring_wait(slot[j], buf[j], CHUNK),
+			      off + j * CHUNK, buf[j]);
+	}
+	cprintf("fsbench: ring, %d outstanding: %d reads of %d bytes in %u msec\n",
+		NOUT, NREAD, CHUNK, sys_time_msec() - start);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static char page[PGSIZE];
+	int fd, i, r;
+
+	if ((fd = open("/fsbench", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /fsbench: %e", fd);
+	for (i = 0; i < PGSIZE; i++)
+		page[i] = i;
+	for (i = 0; i < FILESIZE / PGSIZE; i++)
+		if ((r = write(fd, page, PGSIZE)) != PGSIZE)
+			panic("write /fsbench: %e", r);
+
+	bench_read("page", fd);
+	if ((r = fsring_open()) < 0)
+		panic("fsring_open: %e", r);
+	bench_read("ring", fd);
+	bench_ring_batch(fd);
+
+	// There is no remove; give back the blocks at least
+	ftruncate(fd, 0);
+	close(fd);
+}
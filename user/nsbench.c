@@ -0,0 +1,41 @@
+// Time socket requests to the network server: opening and closing a
+// socket, first with an IPC for every request, then through a request
+// ring.
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+
+#define NROUND		1024
+
+static void
+bench(const char *what)
+{
+	unsigned start;
+	int i, s, r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i++) {
+		if ((s = nsipc_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+			panic("%s: socket: %e", what, s);
+		if ((r = nsipc_close(s)) < 0)
+			panic("%s: close: %e", what, r);
+	}
+	cprintf("nsbench: %s: %d socket/close pairs in %u msec\n",
+		what, NROUND, sys_time_msec() - start);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if (ipc_find_env(ENV_TYPE_NS) == 0) {
+		cprintf("nsbench: no network server\n");
+		return;
+	}
+
+	bench("ipc");
+	if ((r = nsring_open()) < 0)
+		panic("nsring_open: %e", r);
+	bench("ring");
+}
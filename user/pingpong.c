@@ -1,14 +1,82 @@
 // Ping-pong a counter between two processes.
 // Only need to start one of these -- splits into two with fork.
+//
+// Then time NROUND round trips, first as a separate ipc_send and
+// ipc_recv on each side, then as ipc_call and ipc_reply_wait, where
+// the kernel hands the CPU straight from one side to the other.  Run
+// with CPUS=1 to see the handoff; the monitor's top command counts them.
+// Last, the same with IPC_NWORDS words in registers each way.
 
 #include <inc/lib.h>
 
+#define NROUND		10000
+
+static void
+client(envid_t who)
+{
+	unsigned start;
+	uint32_t i;
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i + 1)
+			panic("send/recv: bad reply");
+	}
+	cprintf("pingpong: send/recv: %u round trips in %u msec\n",
+		NROUND, sys_time_msec() - start);
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i++)
+		if (ipc_call(who, i, 0, 0, 0, 0) != i + 1)
+			panic("call/reply_wait: bad reply");
+	cprintf("pingpong: call/reply_wait: %u round trips in %u msec\n",
+		NROUND, sys_time_msec() - start);
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i++) {
+		uint32_t w[IPC_NWORDS] = { i, ~i, i * 3, i ^ 0x55aa };
+		uint32_t rw[IPC_NWORDS];
+
+		if (ipc_callw(who, i, w, rw) != i + 1 ||
+		    memcmp(w, rw, sizeof(w)) != 0)
+			panic("callw/reply_waitw: bad reply");
+	}
+	cprintf("pingpong: callw/reply_waitw: %u round trips in %u msec\n",
+		NROUND, sys_time_msec() - start);
+}
+
+static void
+server(void)
+{
+	envid_t who;
+	uint32_t i, v, w[IPC_NWORDS];
+	int r;
+
+	for (i = 0; i < NROUND; i++) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+
+	v = ipc_recv(&who, 0, 0);
+	for (i = 1; i < NROUND; i++)
+		v = ipc_reply_wait(who, v + 1, 0, 0, &who, 0, 0);
+	ipc_send(who, v + 1, 0, 0);
+
+	// Echo the words back
+	v = ipc_recvw(&who, 0, 0, w);
+	for (i = 1; i < NROUND; i++)
+		v = ipc_reply_waitw(who, v + 1, w, 0, &who, 0, 0, w);
+	if ((r = sys_ipc_send(who, v + 1, w, IPC_WORDS)) < 0)
+		panic("sys_ipc_send: %e", r);
+}
+
 void
 umain(int argc, char **argv)
 {
-	envid_t who;
+	envid_t who, child;
 
-	if ((who = fork()) != 0) {
+	if ((who = child = fork()) != 0) {
 		// get the ball rolling
 		cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
 		ipc_send(who, 0, 0, 0);
@@ -18,12 +86,15 @@ umain(int argc, char **argv)
 		uint32_t i = ipc_recv(&who, 0, 0);
 		cprintf("%x got %d from %x\n", sys_getenvid(), i, who);
 		if (i == 10)
-			return;
+			break;
 		i++;
 		ipc_send(who, i, 0, 0);
 		if (i == 10)
-			return;
+			break;
 	}
 
+	if (child)
+		client(child);
+	else
+		server();
 }
-
@@ -0,0 +1,62 @@
+// Measure how system call throughput scales with the number of CPUs.
+// Run with e.g. "make run-stresssyscall CPUS=4" and compare the totals
+// for different CPU counts.
+//
+// Several children hammer the kernel with cheap system calls and with
+// page allocations for a fixed amount of time, then report how many
+// calls they got through to the parent.
+
+#include <inc/lib.h>
+
+#define NCHILD		8
+#define DURATION	1000	// msec
+#define TESTVA		((void *) 0x10000000)
+
+static unsigned start;
+
+static void
+child(void)
+{
+	unsigned end = start + DURATION;
+	uint32_t ncalls = 0;
+	int r;
+
+	// Start everybody at the same time
+	while (sys_time_msec() < start)
+		sys_yield();
+
+	while (sys_time_msec() < end) {
+		sys_getenvid();
+		if ((r = sys_page_alloc(0, TESTVA, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, TESTVA)) < 0)
+			panic("sys_page_unmap: %e", r);
+		// sys_getenvid, sys_page_alloc, sys_page_unmap, sys_time_msec
+		ncalls += 4;
+	}
+	ipc_send(thisenv->env_parent_id, ncalls, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t total = 0, n;
+	envid_t who;
+	int i;
+
+	// Leave time for the forks before the clock starts
+	start = sys_time_msec() + 200;
+	for (i = 0; i < NCHILD; i++)
+		if (fork() == 0) {
+			child();
+			return;
+		}
+
+	for (i = 0; i < NCHILD; i++) {
+		n = ipc_recv(&who, 0, 0);
+		cprintf("%08x made %u syscalls\n", who, n);
+		total += n;
+	}
+	cprintf("stresssyscall: %u syscalls in %u msec (%u per msec)\n",
+		total, DURATION, total / DURATION);
+}
@@ -0,0 +1,183 @@
+// Test demand-zero memory (see page_user_fault): reserved pages read as
+// zero until written, a write after a read gets a page of its own,
+// reservations are inherited by forked children, PTE_SHARE ones as the
+// same memory, reading more pages than pp_ref can count leaves the
+// shared zero page alone, and a fork that runs out of memory leaves the
+// parent's pages be.
+
+#include <inc/lib.h>
+
+#define RESV		((char *) 0x20000000)	// Private reservations
+#define SHARED		((char *) 0x20400000)	// PTE_SHARE reservation
+#define WRAP		((char *) 0x40000000)	// 0x10000 zero-page reads
+#define NWRAP		0x10000
+#define DATA		((char *) 0x60000000)	// Pages fork must not lose
+#define NDATA		8
+#define NSHARED		256			// Untouched, after DATA
+#define HOG		((char *) 0x70000000)	// Takes all free memory
+#define NTRY		32
+
+static void
+check_zero(const char *what, const char *p)
+{
+	int i;
+
+	for (i = 0; i < PGSIZE; i++)
+		if (p[i] != 0)
+			panic("%s: byte %d of %08x is %d", what, i, p, p[i]);
+}
+
+static void
+check_data(const char *what)
+{
+	int i, j;
+
+	for (i = 0; i < NDATA; i++)
+		for (j = 0; j < PGSIZE; j += 64)
+			if (DATA[i * PGSIZE + j] != (char) (i + j / 64))
+				panic("%s: data page %d lost", what, i);
+}
+
+// Read-then-write of reserved pages, and malloc's use of them
+static void
+test_fault(void)
+{
+	char *p;
+	int r;
+
+	if ((r = sys_page_reserve(0, RESV, 4 * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	check_zero("untouched page", RESV);
+	check_zero("untouched page", RESV + PGSIZE);
+	// The first page is mapped to the zero page now; writing it must
+	// not show through the second
+	RESV[0] = 1;
+	RESV[PGSIZE - 1] = 2;
+	if (RESV[0] != 1 || RESV[PGSIZE - 1] != 2)
+		panic("write after read lost");
+	check_zero("page next to a written one", RESV + PGSIZE);
+	// Write without a read first
+	RESV[2 * PGSIZE] = 3;
+	if (RESV[2 * PGSIZE] != 3)
+		panic("write to an untouched page lost");
+	check_zero("untouched page", RESV + 3 * PGSIZE);
+
+	if ((p = malloc(3 * PGSIZE)) == NULL)
+		panic("malloc failed");
+	check_zero("malloced page", p + PGSIZE);
+	memset(p, 0x55, 3 * PGSIZE);
+	if (p[0] != 0x55 || p[3 * PGSIZE - 1] != 0x55)
+		panic("malloced memory lost a write");
+	free(p);
+}
+
+// Reservations across fork: private ones are copies, whether untouched
+// or mapped to the zero page, and PTE_SHARE ones the same memory
+static void
+test_fork(void)
+{
+	envid_t child;
+	int r;
+
+	if ((r = sys_page_reserve(0, SHARED, 2 * PGSIZE,
+				  PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_reserve shared: %e", r);
+	// RESV + PGSIZE is mapped to the zero page, RESV + 3 * PGSIZE
+	// too, and SHARED untouched
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		check_zero("inherited page", RESV + PGSIZE);
+		RESV[PGSIZE] = 4;
+		RESV[3 * PGSIZE] = 5;
+		SHARED[0] = 6;
+		SHARED[PGSIZE] = 7;
+		exit();
+	}
+	wait(child);
+	check_zero("page the child wrote", RESV + PGSIZE);
+	check_zero("page the child wrote", RESV + 3 * PGSIZE);
+	if (SHARED[0] != 6 || SHARED[PGSIZE] != 7)
+		panic("shared reservation not shared: %d %d",
+		      SHARED[0], SHARED[PGSIZE]);
+}
+
+// Read more demand-zero pages than a 16-bit count holds, then write one:
+// it must get a page of its own, not the zero page
+static void
+test_wrap(void)
+{
+	int i, r;
+
+	if ((r = sys_page_reserve(0, WRAP, (NWRAP + 1) * PGSIZE,
+				  PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	for (i = 0; i < NWRAP; i++)
+		if (WRAP[i * PGSIZE] != 0)
+			panic("page %d of the big reservation isn't zero", i);
+	WRAP[0] = 8;
+	check_zero("zero page after many reads", WRAP + PGSIZE);
+	check_zero("zero page after many reads", WRAP + NWRAP * PGSIZE);
+	check_zero("fresh reservation", RESV + PGSIZE);
+}
+
+// Fork with memory running out, failing at different points; the
+// parent's pages must come through every time
+static void
+test_fork_nomem(void)
+{
+	envid_t child;
+	int i, j, n, r;
+
+	for (i = 0; i < NDATA; i++) {
+		if ((r = sys_page_alloc(0, DATA + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		for (j = 0; j < PGSIZE; j += 64)
+			DATA[i * PGSIZE + j] = i + j / 64;
+	}
+	// In the same page table as DATA, so that fork gives these pages
+	// of their own while copying it
+	if ((r = sys_page_reserve(0, DATA + 64 * PGSIZE, NSHARED * PGSIZE,
+				  PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_reserve: %e", r);
+
+	for (n = 0; sys_page_alloc(0, HOG + n * PGSIZE, PTE_P|PTE_U|PTE_W) == 0; n++)
+		;
+	cprintf("testdemandzero: holding %d pages\n", n);
+	if (n < NTRY)
+		panic("too little memory to test with");
+
+	// The tries free NTRY pages in all, fewer than the shared
+	// reservation alone needs, so every one runs out somewhere
+	for (i = 0; i < NTRY; i++) {
+		sys_page_unmap(0, HOG + --n * PGSIZE);
+		if ((child = sys_fork()) == 0)
+			sys_env_destroy(0);
+		if (child >= 0)
+			panic("fork with %d free pages succeeded", i + 1);
+		if (child != -E_NO_MEM)
+			panic("fork: %e", child);
+		check_data("after a failed fork");
+	}
+
+	// Pages freed by mistake would be handed out again now
+	while (n > 0)
+		sys_page_unmap(0, HOG + --n * PGSIZE);
+	for (i = 0; i < 64; i++) {
+		if ((r = sys_page_alloc(0, HOG + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc after the tries: %e", r);
+		memset(HOG + i * PGSIZE, 0xff, PGSIZE);
+	}
+	check_data("after memory was reused");
+	check_zero("shared reservation after failed forks", DATA + 64 * PGSIZE);
+}
+
+void
+umain(int argc, char **argv)
+{
+	test_fault();
+	test_fork();
+	test_wrap();
+	test_fork_nomem();
+	cprintf("testdemandzero: OK\n");
+}
@@ -0,0 +1,62 @@
+// Test 4MB pages: allocation, fork (private and shared), and unmapping.
+
+#include <inc/lib.h>
+
+#define LARGEVA		((char *) 0x20000000)
+#define SHAREVA		((char *) 0x20400000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t id;
+	int r;
+
+	// Not 4MB-aligned
+	if ((r = sys_page_alloc(0, LARGEVA + PGSIZE, PTE_P|PTE_U|PTE_W|PTE_PS)) != -E_INVAL)
+		panic("sys_page_alloc unaligned 4MB page: %e", r);
+
+	if ((r = sys_page_alloc(0, LARGEVA, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpd[PDX(LARGEVA)] & PTE_PS))
+		panic("no 4MB page at %08x", LARGEVA);
+	if (LARGEVA[0] != 0 || LARGEVA[PTSIZE - 1] != 0)
+		panic("4MB page not zeroed");
+	LARGEVA[0] = 1;
+	LARGEVA[PTSIZE - 1] = 2;
+
+	// Only whole 4MB pages can be mapped
+	if ((r = sys_page_map(0, LARGEVA + PGSIZE, 0, UTEMP, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map of part of a 4MB page: %e", r);
+	if ((r = sys_page_alloc(0, LARGEVA + PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_alloc inside a 4MB page: %e", r);
+
+	if ((r = sys_page_alloc(0, SHAREVA, PTE_P|PTE_U|PTE_W|PTE_PS|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (pageref(SHAREVA) != 1)
+		panic("pageref %d, want 1", pageref(SHAREVA));
+
+	// The child gets a copy of the private page and the shared page
+	// itself
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		if (LARGEVA[0] != 1 || LARGEVA[PTSIZE - 1] != 2)
+			panic("child: 4MB page not copied");
+		LARGEVA[0] = 3;
+		SHAREVA[PTSIZE / 2] = 4;
+		exit();
+	}
+	wait(id);
+	if (LARGEVA[0] != 1)
+		panic("child wrote to the parent's 4MB page");
+	if (SHAREVA[PTSIZE / 2] != 4)
+		panic("child's write to the shared 4MB page is lost");
+
+	// Unmapping any part unmaps all of it
+	if ((r = sys_page_unmap(0, LARGEVA + PTSIZE / 2)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(LARGEVA)] & PTE_P)
+		panic("4MB page still mapped");
+
+	cprintf("testlargepage: OK\n");
+}
@@ -0,0 +1,125 @@
+// Test the futex-based primitives under contention: mutexes must keep
+// threads out of each other's critical sections, cond_signal and
+// cond_broadcast must wake sleeping waiters, cond_timedwait must time
+// out, and sys_futex_wait must not sleep if the value has changed.
+
+#include <inc/lib.h>
+
+#define NTHREAD		4
+#define NITER		2000
+
+static mutex_t m;
+static cond_t c;
+static uint32_t counter;		// Protected by m
+static volatile uint32_t inside;
+static uint32_t nasleep, go;		// Protected by m
+static volatile uint32_t nwoken;
+
+static void
+adder(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NITER; i++) {
+		mutex_lock(&m);
+		if (__sync_fetch_and_add(&inside, 1) != 0)
+			panic("two threads hold the mutex");
+		counter++;
+		// Give up the CPU now and then while holding it, so that
+		// the others find it taken and sleep
+		if (i % 64 == 0)
+			sys_yield();
+		__sync_fetch_and_sub(&inside, 1);
+		mutex_unlock(&m);
+	}
+}
+
+static void
+waiter(void *arg)
+{
+	mutex_lock(&m);
+	nasleep++;
+	while (!go)
+		cond_wait(&c, &m);
+	mutex_unlock(&m);
+	__sync_fetch_and_add(&nwoken, 1);
+}
+
+// Start n waiters and return once they have all gone to sleep on c.
+static void
+start_waiters(thdid_t *t, int n)
+{
+	int i;
+
+	nasleep = go = nwoken = 0;
+	for (i = 0; i < n; i++)
+		t[i] = create_thread(waiter, 0);
+	while (1) {
+		mutex_lock(&m);
+		// A waiter counted itself under m, so it has read c's
+		// sequence number before we can signal
+		if (nasleep == n)
+			break;
+		mutex_unlock(&m);
+		sys_yield();
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	volatile uint32_t word = 1;
+	thdid_t t[NTHREAD];
+	unsigned start;
+	int i, r;
+
+	// A value mismatch returns at once
+	if ((r = sys_futex_wait(&word, 0, 0)) != -E_AGAIN)
+		panic("sys_futex_wait on a changed value returned %e", r);
+
+	// Mutual exclusion
+	for (i = 0; i < NTHREAD; i++)
+		t[i] = create_thread(adder, 0);
+	for (i = 0; i < NTHREAD; i++)
+		wait_thread(t[i]);
+	if (counter != NTHREAD * NITER)
+		panic("counter is %d, not %d", counter, NTHREAD * NITER);
+	if (mutex_trylock(&m) < 0)
+		panic("mutex still held");
+	if (mutex_trylock(&m) != -E_AGAIN)
+		panic("mutex_trylock took a held mutex");
+	mutex_unlock(&m);
+
+	// A timed wait with nobody to signal times out, mutex held again
+	mutex_lock(&m);
+	start = sys_time_msec();
+	if ((r = cond_timedwait(&c, &m, 50)) != -E_TIMEOUT)
+		panic("cond_timedwait returned %e, not a timeout", r);
+	if (sys_time_msec() - start < 40)
+		panic("cond_timedwait timed out after %u msec",
+		      sys_time_msec() - start);
+	if (mutex_trylock(&m) != -E_AGAIN)
+		panic("cond_timedwait returned without the mutex");
+	mutex_unlock(&m);
+
+	// cond_signal wakes a sleeping waiter
+	start_waiters(t, 1);
+	go = 1;
+	cond_signal(&c);
+	mutex_unlock(&m);
+	wait_thread(t[0]);
+	if (nwoken != 1)
+		panic("cond_signal woke nobody");
+
+	// cond_broadcast wakes them all
+	start_waiters(t, NTHREAD);
+	go = 1;
+	cond_broadcast(&c);
+	mutex_unlock(&m);
+	for (i = 0; i < NTHREAD; i++)
+		wait_thread(t[i]);
+	if (nwoken != NTHREAD)
+		panic("cond_broadcast woke %d of %d", nwoken, NTHREAD);
+
+	cprintf("testsync: OK\n");
+}
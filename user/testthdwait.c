@@ -0,0 +1,48 @@
+// Test wait_thread: threads waiting on the status of a thread that
+// exits must wake up, and waiting for a thread already gone returns.
+
+#include <inc/lib.h>
+
+#define NWAIT		4
+
+static thdid_t sleeper;
+static volatile uint32_t nwoken;
+
+static void
+sleep_then_exit(void *arg)
+{
+	// Long enough for the waiters to be asleep on our status
+	sys_thd_sleep(100);
+}
+
+static void
+waiter(void *arg)
+{
+	wait_thread(sleeper);
+	__sync_fetch_and_add(&nwoken, 1);
+}
+
+void
+umain(int argc, char **argv)
+{
+	thdid_t w[NWAIT];
+	int i;
+
+	sleeper = create_thread(sleep_then_exit, 0);
+	for (i = 0; i < NWAIT; i++)
+		w[i] = create_thread(waiter, 0);
+
+	wait_thread(sleeper);
+	if (thds[THDX(sleeper)].thd_id == sleeper &&
+	    thds[THDX(sleeper)].thd_status != THD_FREE)
+		panic("wait_thread returned before the thread was freed");
+	for (i = 0; i < NWAIT; i++)
+		wait_thread(w[i]);
+	if (nwoken != NWAIT)
+		panic("%d of %d waiters woken", nwoken, NWAIT);
+
+	// Gone already
+	wait_thread(sleeper);
+
+	cprintf("testthdwait: OK\n");
+}
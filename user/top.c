@@ -0,0 +1,61 @@
+// Show where the CPU time went, from the accounting the kernel maps
+// read-only at UENVS, UTHDS and UCPUSTATS.  Run it from the shell while
+// fs, ns and httpd are busy; the kernel monitor's top command shows the
+// same numbers in milliseconds.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t busy = 0, total, runtime, wait_time;
+	uint32_t runs, migrations;
+	const volatile struct Env *e, *kenvs;
+	const volatile struct Thd *t, *kt, *kthds;
+	int i;
+
+	binaryname = "top";
+
+	// The links inside these structures are kernel addresses; our own
+	// thread tells us where the kernel keeps the arrays.
+	kenvs = thisthd->thd_env - (thisenv - envs);
+	kthds = (const volatile struct Thd *) &kenvs[NENV];
+
+	cprintf("CPU  BUSY  SWITCHES  STEALS  HANDOFFS\n");
+	for (i = 0; i < NCPU; i++) {
+		total = cpustats[i].cs_busy + cpustats[i].cs_idle;
+		if (total == 0)
+			continue;
+		busy += cpustats[i].cs_busy;
+		cprintf("%3d  %3u%%  %8u  %6u  %8u\n", i,
+			(uint32_t) (cpustats[i].cs_busy * 100 / total),
+			cpustats[i].cs_switches, cpustats[i].cs_steals,
+			cpustats[i].cs_handoffs);
+	}
+	if (busy == 0)
+		busy = 1;
+
+	// Shares of all the busy time, and waiting time relative to
+	// running time
+	cprintf("\nENV       CPU%%  WAIT%%  THREADS  SWITCHES  MIGR\n");
+	for (e = envs; e < envs + envtabs->et_nenv; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		runtime = e->env_runtime;
+		wait_time = e->env_wait_time;
+		runs = e->env_runs;
+		migrations = e->env_migrations;
+		i = 0;
+		for (kt = e->env_thd_head; kt; kt = t->thd_next, i++) {
+			t = &thds[kt - kthds];
+			runtime += t->thd_runtime;
+			wait_time += t->thd_wait_time;
+			runs += t->thd_runs;
+			migrations += t->thd_migrations;
+		}
+		cprintf("%08x  %3u   %4u  %7d  %8u  %4u\n", e->env_id,
+			(uint32_t) (runtime * 100 / busy),
+			runtime ? (uint32_t) (wait_time * 100 / runtime) : 0,
+			i, runs, migrations);
+	}
+}